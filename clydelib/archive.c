@@ -0,0 +1,253 @@
+/* gcc -W -Wall -pedantic -std=c99 -D_GNU_SOURCE `pkg-config --cflags lua` -fPIC -shared -o archive.so archive.c -larchive */
+#include <lua.h>
+#include <lualib.h>
+#include <lauxlib.h>
+
+#include <archive.h>
+#include <archive_entry.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+/* libarchive 3 renamed a few of the functions we use. */
+#if ARCHIVE_VERSION_NUMBER < 3000000
+#define archive_read_support_filter_all archive_read_support_compression_all
+#define archive_read_free               archive_read_finish
+#endif
+
+#define READER_MT "clyde_archive_reader"
+
+/* Entries are extracted like "bsdtar --no-same-owner --no-same-permissions"
+   would, but refusing to write outside of the destination directory. */
+#define EXTRACT_FLAGS ( ARCHIVE_EXTRACT_TIME                                \
+                        | ARCHIVE_EXTRACT_SECURE_NODOTDOT                   \
+                        | ARCHIVE_EXTRACT_SECURE_SYMLINKS )
+
+typedef struct reader {
+    struct archive       *ar;
+    struct archive_entry *entry; /* the current entry or NULL */
+    lua_State            *L;     /* state of the current method call */
+    int                  readfn; /* registry ref to the Lua read function */
+    int                  chunk;  /* registry ref to the last chunk read */
+    int                  eof;
+} reader;
+
+/* Called by libarchive when it wants more data. We call the Lua read
+   function, which returns the next chunk as a string or nil at the end.
+   The chunk is kept referenced until the next call, as libarchive reads
+   it from our buffer. */
+static ssize_t reader_callback ( struct archive *ar, void *data,
+                                 const void **buf )
+{
+    reader *r = data;
+    lua_State *L = r->L;
+    size_t len;
+
+    if ( r->eof ) return 0;
+
+    luaL_unref( L, LUA_REGISTRYINDEX, r->chunk );
+    r->chunk = LUA_NOREF;
+
+    lua_rawgeti( L, LUA_REGISTRYINDEX, r->readfn );
+    if ( lua_pcall( L, 0, 1, 0 ) != 0 ) {
+        archive_set_error( ar, -1, "%s", lua_tostring( L, -1 ));
+        lua_pop( L, 1 );
+        return -1;
+    }
+
+    if ( lua_isnil( L, -1 )) {
+        lua_pop( L, 1 );
+        r->eof = 1;
+        return 0;
+    }
+
+    if ( lua_type( L, -1 ) != LUA_TSTRING ) {
+        lua_pop( L, 1 );
+        archive_set_error( ar, -1, "read function must return a string" );
+        return -1;
+    }
+
+    *buf = lua_tolstring( L, -1, &len );
+    r->chunk = luaL_ref( L, LUA_REGISTRYINDEX );
+
+    /* An empty chunk would look like the end of the archive. */
+    if ( len == 0 ) return reader_callback( ar, data, buf );
+    return len;
+}
+
+static reader *check_reader ( lua_State *L )
+{
+    reader *r = luaL_checkudata( L, 1, READER_MT );
+    if ( r->ar == NULL ) luaL_error( L, "archive reader is closed" );
+    r->L = L;
+    return r;
+}
+
+static int archive_error ( lua_State *L, reader *r )
+{
+    const char *err = archive_error_string( r->ar );
+    return luaL_error( L, "%s", err ? err : "unknown archive error" );
+}
+
+static void reader_free ( lua_State *L, reader *r )
+{
+    if ( r->ar != NULL ) {
+        archive_read_free( r->ar );
+        r->ar = NULL;
+    }
+    luaL_unref( L, LUA_REGISTRYINDEX, r->readfn );
+    luaL_unref( L, LUA_REGISTRYINDEX, r->chunk );
+    r->readfn = r->chunk = LUA_NOREF;
+    r->entry  = NULL;
+}
+
+/* archive.open( readfn ) opens an archive, of any format and compression
+   libarchive knows, which is read by calling readfn. */
+static int clyde_archive_open ( lua_State *L )
+{
+    reader *r;
+
+    luaL_checktype( L, 1, LUA_TFUNCTION );
+
+    r = lua_newuserdata( L, sizeof( reader ));
+    memset( r, 0, sizeof( reader ));
+    r->readfn = r->chunk = LUA_NOREF;
+    luaL_getmetatable( L, READER_MT );
+    lua_setmetatable( L, -2 );
+
+    r->L  = L;
+    r->ar = archive_read_new();
+    if ( r->ar == NULL ) return luaL_error( L, "out of memory" );
+    archive_read_support_filter_all( r->ar );
+    archive_read_support_format_all( r->ar );
+
+    lua_pushvalue( L, 1 );
+    r->readfn = luaL_ref( L, LUA_REGISTRYINDEX );
+
+    if ( archive_read_open( r->ar, r, NULL, reader_callback, NULL )
+         != ARCHIVE_OK ) {
+        lua_pushstring( L, archive_error_string( r->ar ));
+        reader_free( L, r );
+        return lua_error( L );
+    }
+
+    return 1;
+}
+
+/* reader:next() moves to the next entry and returns its path name and
+   its type ("file", "dir", "link" or "other"). Returns nil at the end. */
+static int clyde_reader_next ( lua_State *L )
+{
+    reader *r = check_reader( L );
+    int ret = archive_read_next_header( r->ar, &r->entry );
+    mode_t type;
+
+    if ( ret == ARCHIVE_EOF ) {
+        r->entry = NULL;
+        return 0;
+    }
+    if ( ret < ARCHIVE_WARN ) {
+        r->entry = NULL;
+        return archive_error( L, r );
+    }
+
+    lua_pushstring( L, archive_entry_pathname( r->entry ));
+    type = archive_entry_filetype( r->entry );
+    lua_pushstring( L, type == AE_IFREG ? "file"
+                       : type == AE_IFDIR ? "dir"
+                       : type == AE_IFLNK ? "link"
+                       : "other" );
+    return 2;
+}
+
+/* reader:read() returns the data of the current entry. */
+static int clyde_reader_read ( lua_State *L )
+{
+    reader *r = check_reader( L );
+    char buf[ 8192 ];
+    luaL_Buffer b;
+    ssize_t len;
+
+    if ( r->entry == NULL ) return luaL_error( L, "no current entry" );
+
+    luaL_buffinit( L, &b );
+    while (( len = archive_read_data( r->ar, buf, sizeof( buf ))) > 0 ) {
+        luaL_addlstring( &b, buf, len );
+    }
+    if ( len < 0 ) return archive_error( L, r );
+
+    luaL_pushresult( &b );
+    return 1;
+}
+
+/* Prefixes path with destdir, leaving the result on the stack. */
+static const char *push_destpath ( lua_State *L, const char *destdir,
+                                   const char *path )
+{
+    lua_pushfstring( L, "%s/%s", destdir, path );
+    return lua_tostring( L, -1 );
+}
+
+/* reader:extract( destdir ) writes the current entry to disk, under the
+   directory destdir. */
+static int clyde_reader_extract ( lua_State *L )
+{
+    reader *r = check_reader( L );
+    const char *destdir = luaL_checkstring( L, 2 );
+    const char *hardlink;
+
+    if ( r->entry == NULL ) return luaL_error( L, "no current entry" );
+
+    archive_entry_set_pathname(
+        r->entry,
+        push_destpath( L, destdir, archive_entry_pathname( r->entry )));
+
+    hardlink = archive_entry_hardlink( r->entry );
+    if ( hardlink != NULL ) {
+        archive_entry_set_hardlink( r->entry,
+                                    push_destpath( L, destdir, hardlink ));
+    }
+
+    if ( archive_read_extract( r->ar, r->entry, EXTRACT_FLAGS )
+         < ARCHIVE_WARN ) {
+        return archive_error( L, r );
+    }
+
+    return 0;
+}
+
+static int clyde_reader_close ( lua_State *L )
+{
+    reader *r = luaL_checkudata( L, 1, READER_MT );
+    reader_free( L, r );
+    return 0;
+}
+
+static luaL_Reg const reader_methods[] = {
+    { "next",                       clyde_reader_next },
+    { "read",                       clyde_reader_read },
+    { "extract",                    clyde_reader_extract },
+    { "close",                      clyde_reader_close },
+    { NULL,                         NULL }
+};
+
+static luaL_Reg const pkg_funcs[] = {
+    { "open",                       clyde_archive_open },
+    { NULL,                         NULL }
+};
+
+int luaopen_clydelib_archive ( lua_State *L )
+{
+    luaL_newmetatable( L, READER_MT );
+    lua_newtable( L );
+    luaL_register( L, NULL, reader_methods );
+    lua_setfield( L, -2, "__index" );
+    lua_pushcfunction( L, clyde_reader_close );
+    lua_setfield( L, -2, "__gc" );
+    lua_pop( L, 1 );
+
+    lua_newtable( L );
+    luaL_register( L, NULL, pkg_funcs );
+
+    return 1;
+}
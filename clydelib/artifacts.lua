@@ -0,0 +1,294 @@
+module(..., package.seeall)
+---a shared store of built AUR packages---
+local lfs      = require "lfs"
+local utilcore = require "clydelib.utilcore"
+local util     = require "clydelib.util"
+local pkgbuild = require "clydelib.pkgbuild"
+local lprintf  = util.lprintf
+
+--[[ ArtifactStore in clyde.conf names a directory, which any number of
+     machines or chroots may share, of packages makepkg built. Each
+     entry is a directory named after the SHA-256 of everything which
+     went into the build: the PKGBUILD as it is after customizing, the
+     files of the source package it lists as sources, and the settings
+     of makepkg.conf which change what gets built. Anyone who would
+     build the same thing installs the stored packages instead.
+
+     Each entry has a MANIFEST, in the format of sha256sum, of the
+     packages in it. Only those are restored, and only if every one of
+     them has the digest listed; anything else counts as a miss.
+
+     Entries are written under a temporary name and renamed into place
+     so that nobody sees half of one. Using an entry touches it and,
+     once the store is over ArtifactStoreSize, the entries used least
+     recently are removed. Packages with VCS sources build whatever is
+     newest upstream and are never stored. ]]--
+
+local MAKEPKG_CONF = "/etc/makepkg.conf"
+local CONF_VARS    = { "CARCH", "CHOST", "CFLAGS", "CXXFLAGS", "LDFLAGS",
+                       "OPTIONS", "BUILDENV", "PKGEXT" }
+local VCS_SOURCE   = { "^git[+:]", "^svn[+:]", "^hg[+:]", "^bzr[+:]",
+                       "^cvs[+:]", "^darcs[+:]" }
+local VCS_SUFFIX   = { "%-git$", "%-svn$", "%-hg$", "%-bzr$", "%-cvs$",
+                       "%-darcs$" }
+local BLOCKSIZE    = 65536
+local MANIFEST     = "MANIFEST"
+
+stats = { hits = 0, misses = 0, published = 0, evicted = 0 }
+
+function enabled ()
+    return config.artifact_store and true or false
+end
+
+local function entry_path ( key )
+    return config.artifact_store .. "/" .. key
+end
+
+local function read_file ( path )
+    local fh = io.open( path, "rb" )
+    if not fh then return nil end
+    local text = fh:read( "*a" )
+    fh:close()
+    return text
+end
+
+local function copy_file ( src, dest )
+    local input, err = io.open( src, "rb" )
+    if not input then return nil, err end
+    local output, err = io.open( dest, "wb" )
+    if not output then input:close(); return nil, err end
+
+    while true do
+        local chunk = input:read( BLOCKSIZE )
+        if not chunk then break end
+        output:write( chunk )
+    end
+    input:close()
+    output:close()
+    return true
+end
+
+local function remove_entry ( path )
+    for file in lfs.dir( path ) do
+        if file ~= "." and file ~= ".." then os.remove( path .. "/" .. file ) end
+    end
+    return os.remove( path )
+end
+
+local function is_vcs ( info )
+    for i, name in ipairs( info.pkgname ) do
+        for j, pattern in ipairs( VCS_SUFFIX ) do
+            if name:match( pattern ) then return true end
+        end
+    end
+    for i, source in ipairs( info.source ) do
+        local target = source:match( "::(.*)$" ) or source
+        for j, pattern in ipairs( VCS_SOURCE ) do
+            if target:match( pattern ) then return true end
+        end
+    end
+    return false
+end
+
+--[[ Returns the key of the package extracted in pkgdir, or nil if it
+     cannot be stored. Remote sources are in the key through their
+     URLs and checksums, which are part of the PKGBUILD. ]]--
+function key ( pkgdir )
+    local text = read_file( pkgdir .. "/PKGBUILD" )
+    if not text then return nil end
+    local info = pkgbuild.parse( text )
+    if is_vcs( info ) then return nil end
+
+    local parts = { "PKGBUILD", text }
+    local files = { info.install[1] }
+    for i, source in ipairs( info.source ) do
+        if not source:match( "://" ) then
+            table.insert( files, source:match( "::(.*)$" ) or source )
+        end
+    end
+    table.sort( files )
+    for i, file in ipairs( files ) do
+        local content = read_file( pkgdir .. "/" .. file )
+        if not content then return nil end
+        table.insert( parts, file )
+        table.insert( parts, content )
+    end
+
+    for i, var in ipairs( CONF_VARS ) do
+        table.insert( parts, var .. "="
+                      .. ( util.getbasharray( MAKEPKG_CONF, var ) or "" ))
+    end
+
+    -- The name is only there for people looking at the store.
+    local name = ( info.pkgname[1] or "unknown" ):gsub( "[^%w@._+-]", "_" )
+    return name .. "-" .. utilcore.sha256( table.concat( parts, "\0" ))
+end
+
+-- Returns the names of the package files makepkg makes from the
+-- PKGBUILD in pkgdir.
+function files ( pkgdir )
+    local info  = pkgbuild.parse( assert( read_file( pkgdir .. "/PKGBUILD" )))
+    local carch = util.getbasharray( MAKEPKG_CONF, "CARCH" ) or ""
+    local ext   = util.getbasharray( MAKEPKG_CONF, "PKGEXT" ) or ""
+    local arch  = info.arch[1] == "any" and "any" or carch
+
+    local version = pkgbuild.field( info, "pkgver" ) .. "-"
+        .. pkgbuild.field( info, "pkgrel" )
+    if pkgbuild.field( info, "epoch" ) ~= "" then
+        version = pkgbuild.field( info, "epoch" ) .. ":" .. version
+    end
+
+    local names = {}
+    for i, name in ipairs( info.pkgname ) do
+        table.insert( names, name .. "-" .. version .. "-" .. arch .. ext )
+    end
+    return names
+end
+
+-- Returns a list of { file, digest } from the manifest of the entry
+-- at path, or nil and a message.
+local function read_manifest ( path )
+    local text = read_file( path .. "/" .. MANIFEST )
+    if not text then return nil, "no manifest" end
+
+    local list = {}
+    for line in text:gmatch( "[^\n]+" ) do
+        local digest, file = line:match( "^(%x+)  ([^/]+)$" )
+        if not digest or #digest ~= 64 or file == "." or file == ".."
+            or file == MANIFEST then
+            return nil, "bad manifest line: " .. line
+        end
+        table.insert( list, { file = file; digest = digest } )
+    end
+    if not next( list ) then return nil, "empty manifest" end
+    return list
+end
+
+-- Copies the files in the manifest of the entry at path into destdir,
+-- each under a temporary name until all of them are there and match
+-- their digests. Returns the list of files or nil and a message.
+local function copy_entry ( path, destdir )
+    local list, err = read_manifest( path )
+    if not list then return nil, err end
+
+    local copied, ok = {}, true
+    for i, item in ipairs( list ) do
+        local tmp = destdir .. "/" .. item.file .. ".part"
+        table.insert( copied, tmp )
+        ok, err = copy_file( path .. "/" .. item.file, tmp )
+        if ok and utilcore.sha256file( tmp ) ~= item.digest then
+            ok, err = nil, item.file .. " does not match the manifest"
+        end
+        if not ok then break end
+    end
+
+    local files = {}
+    for i, tmp in ipairs( copied ) do
+        if ok then
+            local file = list[i].file
+            ok, err = os.rename( tmp, destdir .. "/" .. file )
+            table.insert( files, file )
+        end
+        if not ok then os.remove( tmp ) end
+    end
+    if not ok then return nil, err end
+    return files
+end
+
+--[[ Copies the stored packages of key into destdir. Returns the list
+     of files copied, or nil if the store does not have all of them as
+     they were stored. An entry being evicted while we copy it is a
+     miss too. ]]--
+function restore ( key, destdir )
+    local path = entry_path( key )
+    local files, err
+    if lfs.attributes( path, "mode" ) == "directory" then
+        files, err = copy_entry( path, destdir )
+        if not files then
+            lprintf( "LOG_WARNING", "artifact store: ignoring %s (%s)\n",
+                     key, tostring( err ))
+        end
+    end
+    if not files then
+        stats.misses = stats.misses + 1
+        return nil
+    end
+
+    lfs.touch( path )
+    stats.hits = stats.hits + 1
+    return files
+end
+
+-- Removes the entries used least recently until the store fits in
+-- ArtifactStoreSize.
+function evict ()
+    local limit, total, entries = config.artifact_store_size * 1048576, 0, {}
+    for name in lfs.dir( config.artifact_store ) do
+        local path = entry_path( name )
+        local attr = lfs.attributes( path )
+        if name ~= "." and name ~= ".." and attr
+            and attr.mode == "directory" and not name:match( "%.tmp%-" ) then
+            local entry = { path = path; time = attr.modification; size = 0 }
+            for file in lfs.dir( path ) do
+                if file ~= "." and file ~= ".." then
+                    entry.size = entry.size
+                        + ( lfs.attributes( path .. "/" .. file, "size" ) or 0 )
+                end
+            end
+            total = total + entry.size
+            table.insert( entries, entry )
+        end
+    end
+    if total <= limit then return end
+
+    table.sort( entries, function ( a, b ) return a.time < b.time end )
+    for i, entry in ipairs( entries ) do
+        if total <= limit then break end
+        if remove_entry( entry.path ) then
+            total = total - entry.size
+            stats.evicted = stats.evicted + 1
+            lprintf( "LOG_DEBUG", "artifact store: evicted %s\n", entry.path )
+        end
+    end
+end
+
+--[[ Stores the files named in names, from srcdir, as the entry for
+     key. Someone else storing the same key at the same time is fine:
+     whichever rename comes second fails and the entry is the same. ]]--
+function publish ( key, srcdir, names )
+    local path = entry_path( key )
+    if lfs.attributes( path, "mode" ) == "directory" then return true end
+
+    -- os.tmpname() gives us a name no other process here has.
+    local scratch = os.tmpname()
+    os.remove( scratch )
+    local tmp = path .. ".tmp-" .. scratch:match( "([^/]+)$" )
+
+    local oldmask = utilcore.umask( "0022" )
+    local ok, err = pcall( function ()
+        if lfs.attributes( config.artifact_store, "mode" ) ~= "directory" then
+            utilcore.mkdir( config.artifact_store, "0755" )
+        end
+        utilcore.mkdir( tmp, "0755" )
+        local manifest = {}
+        for i, name in ipairs( names ) do
+            assert( copy_file( srcdir .. "/" .. name, tmp .. "/" .. name ))
+            table.insert( manifest, assert( utilcore.sha256file( tmp .. "/" .. name ))
+                                    .. "  " .. name .. "\n" )
+        end
+        local fh = assert( io.open( tmp .. "/" .. MANIFEST, "w" ))
+        fh:write( table.concat( manifest ))
+        fh:close()
+    end )
+    utilcore.umask( oldmask )
+
+    if not ok or not os.rename( tmp, path ) then
+        if lfs.attributes( tmp, "mode" ) then remove_entry( tmp ) end
+        if not ok then return nil, err end
+        return true
+    end
+
+    stats.published = stats.published + 1
+    evict()
+    return true
+end
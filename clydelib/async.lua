@@ -0,0 +1,279 @@
+module(..., package.seeall)
+---running network requests concurrently---
+local socket = require "socket"
+
+--[[ Tasks are coroutines which do their I/O with the functions below.
+     When a socket would block, the task yields the socket, what it is
+     waiting for (read or write) and until when back to run(), which
+     waits on all of the tasks' sockets at once with socket.select and
+     wakes up tasks whose deadline passed with a timeout. Outside of a
+     task the same functions simply block, for as long as the timeout.
+
+     Lua 5.1 cannot yield across pcall or C functions, so code that
+     runs inside a task must not do its I/O from inside a pcall. ]]--
+
+local DEFAULT_CONCURRENCY     = 4
+local DEFAULT_CONNECT_TIMEOUT = 10 -- seconds
+local DEFAULT_READ_TIMEOUT    = 30 -- seconds
+
+local pending  = {} -- tasks which have not been started yet
+local running  = {} -- coroutine => task, for started tasks
+local nrunning = 0
+
+-- The number of tasks which may run at once.
+function concurrency ()
+    return config.aur_concurrency or DEFAULT_CONCURRENCY
+end
+
+-- How long connecting (with the TLS handshake) may take, and how long
+-- we wait for a socket to become readable or writable again.
+function connect_timeout ()
+    return config.aur_connect_timeout or DEFAULT_CONNECT_TIMEOUT
+end
+
+function read_timeout ()
+    return config.aur_timeout or DEFAULT_READ_TIMEOUT
+end
+
+-- Returns the task we are running inside of, or nil.
+function current ()
+    local co = coroutine.running()
+    return co and running[ co ]
+end
+
+-- Maps a socket error to the direction we must wait on, or nil if the
+-- error is real. luasec says which way it wants, luasocket only says
+-- "timeout" and we know from the call which way we were going.
+local function blocked_on ( err, mode )
+    if err == "wantread" then return "read"
+    elseif err == "wantwrite" then return "write"
+    elseif err == "timeout" then return mode
+    end
+end
+
+-- Sockets are switched to non-blocking mode while used inside a task
+-- and back to timeout seconds when used outside of one (say, after
+-- returning to a pool).
+local function in_task ( sock, timeout )
+    if current() then
+        sock:settimeout( 0 )
+        return true
+    end
+    sock:settimeout( timeout or read_timeout())
+    return false
+end
+
+-- Gives the socket back to run() until it is ready for mode. Returns
+-- false if the deadline passed first.
+local function wait ( sock, mode, deadline )
+    return coroutine.yield( sock, mode, deadline ) ~= nil
+end
+
+function connect ( sock, host, port )
+    if not in_task( sock, connect_timeout()) then
+        return sock:connect( host, port )
+    end
+
+    -- Name lookup still blocks, only the connect itself is waited on.
+    local deadline = socket.gettime() + connect_timeout()
+    local ok, err = sock:connect( host, port )
+    while not ok do
+        if err == "already connected" then return 1 end
+        if err ~= "timeout" and err ~= "Operation already in progress" then
+            return nil, err
+        end
+        if not wait( sock, "write", deadline ) then return nil, "timeout" end
+        ok, err = sock:connect( host, port )
+    end
+    return ok
+end
+
+function handshake ( sock )
+    if not in_task( sock, connect_timeout()) then
+        return sock:dohandshake()
+    end
+
+    local deadline = socket.gettime() + connect_timeout()
+    while true do
+        local ok, err = sock:dohandshake()
+        if ok then return ok end
+
+        local mode = blocked_on( err, "read" )
+        if not mode then return nil, err end
+        if not wait( sock, mode, deadline ) then return nil, "timeout" end
+    end
+end
+
+-- Same results as sock:receive( pattern ).
+function receive ( sock, pattern )
+    if not in_task( sock ) then return sock:receive( pattern ) end
+
+    local partial
+    while true do
+        local data, err, part = sock:receive( pattern, partial )
+        if data then return data end
+
+        local mode = blocked_on( err, "read" )
+        if not mode then return nil, err, part end
+        partial = part
+        if not wait( sock, mode, socket.gettime() + read_timeout()) then
+            return nil, "timeout", partial
+        end
+    end
+end
+
+-- Same results as sock:send( data ).
+function send ( sock, data )
+    if not in_task( sock ) then return sock:send( data ) end
+
+    local i = 1
+    while true do
+        local last, err, lastsent = sock:send( data, i )
+        if last then return last end
+
+        local mode = blocked_on( err, "write" )
+        if not mode then return nil, err, lastsent end
+        i = lastsent + 1
+        if not wait( sock, mode, socket.gettime() + read_timeout()) then
+            return nil, "timeout", lastsent
+        end
+    end
+end
+
+-- Waits at most timeout seconds for one of socks to become readable
+-- and returns it, or nil and "timeout".
+function select_readable ( socks, timeout )
+    if not current() then
+        local readable = socket.select( socks, nil, timeout )
+        if readable[1] then return readable[1] end
+        return nil, "timeout"
+    end
+
+    for i, sock in ipairs( socks ) do sock:settimeout( 0 ) end
+    local sock = coroutine.yield( socks, "any", socket.gettime() + timeout )
+    if sock then return sock end
+    return nil, "timeout"
+end
+
+------------------------------------------------------------------------------
+
+--[[ Creates a task which calls fn with the given arguments. Tasks are
+     started by run(). When a task finishes, task.ok and task.results
+     hold what pcall would have returned and task.callback, if set, is
+     called with those values. ]]--
+function spawn ( fn, ... )
+    local task = { fn = fn; args = { n = select( "#", ... ), ... } }
+    table.insert( pending, task )
+    return task
+end
+
+local function finish ( task, ok, ... )
+    running[ task.co ] = nil
+    nrunning = nrunning - 1
+
+    task.done, task.ok = true, ok
+    task.results = { n = select( "#", ... ), ... }
+    task.sock, task.mode, task.deadline = nil, nil, nil
+    if task.callback then task.callback( ok, ... ) end
+end
+
+local function step ( task, ... )
+    local co = task.co
+    local function resumed ( ok, ... )
+        if coroutine.status( co ) == "dead" then
+            return finish( task, ok, ... )
+        end
+        task.sock, task.mode, task.deadline = ...
+    end
+    resumed( coroutine.resume( co, ... ))
+end
+
+local function start ( task )
+    task.co = coroutine.create( task.fn )
+    running[ task.co ] = task
+    nrunning = nrunning + 1
+    step( task, unpack( task.args, 1, task.args.n ))
+end
+
+-- Starts pending tasks if there is room and resumes the tasks whose
+-- sockets are ready, waiting at most timeout seconds (nil is forever)
+-- or until the first deadline. Tasks whose deadline passed are resumed
+-- with nothing, the others with the socket which became ready.
+local function turn ( timeout )
+    while #pending > 0 and nrunning < concurrency() do
+        start( table.remove( pending, 1 ))
+    end
+    if nrunning == 0 then return end
+
+    local readers, writers, waiting = {}, {}, {}
+    local first
+    for co, task in pairs( running ) do
+        local socks = task.mode == "any" and task.sock or { task.sock }
+        for i, sock in ipairs( socks ) do
+            if task.mode == "write" then table.insert( writers, sock )
+            else table.insert( readers, sock ) end
+            waiting[ sock ] = task
+        end
+        if task.deadline and ( not first or task.deadline < first ) then
+            first = task.deadline
+        end
+    end
+    if first then
+        local left = math.max( 0, first - socket.gettime())
+        if not timeout or left < timeout then timeout = left end
+    end
+
+    local readable, writable = socket.select( readers, writers, timeout )
+    local woken = {}
+    for i, socks in ipairs{ readable, writable } do
+        for j, sock in ipairs( socks ) do
+            local task = waiting[ sock ]
+            if not woken[ task ] then
+                woken[ task ] = true
+                step( task, sock )
+            end
+        end
+    end
+
+    local now = socket.gettime()
+    for co, task in pairs( running ) do
+        if not woken[ task ] and task.deadline and task.deadline <= now then
+            step( task )
+        end
+    end
+end
+
+-- Runs tasks until every one, including those spawned meanwhile, is done.
+function run ()
+    assert( not current(), "async.run() cannot be called from a task" )
+
+    while #pending > 0 or nrunning > 0 do turn() end
+end
+
+-- Lets tasks do whatever they can without waiting, so that they make
+-- progress while we are busy with something else. Returns true if
+-- there are tasks left.
+function poll ()
+    assert( not current(), "async.poll() cannot be called from a task" )
+
+    turn( 0 )
+    return #pending > 0 or nrunning > 0
+end
+
+--[[ Calls every function in fns concurrently and returns when they are
+     all done. The first error raised by any of them is raised again.
+     Inside of a task the functions are just called one by one. ]]--
+function all ( fns )
+    if current() then
+        for i, fn in ipairs( fns ) do fn() end
+        return
+    end
+
+    local tasks = {}
+    for i, fn in ipairs( fns ) do tasks[i] = spawn( fn ) end
+    run()
+
+    for i, task in ipairs( tasks ) do
+        if not task.ok then error( task.results[1], 0 ) end
+    end
+end
@@ -2,7 +2,7 @@ module(..., package.seeall)
 ---downloading AUR stuff---
 local lfs     = require "lfs"
 local socket  = require "socket"
-local http    = require "socket.http"
+local url     = require "socket.url"
 local ltn12   = require "ltn12"
 local zlib    = require "zlib"
 local yajl    = require "yajl"
@@ -12,6 +12,7 @@ local alpm    = require "lualpm"
 local util    = require "clydelib.util"
 local printf  = util.printf
 local eprintf = util.eprintf
+local lprintf = util.lprintf
 local yesno   = util.yesno
 local noyes   = util.noyes
 
@@ -20,37 +21,59 @@ local geteuid = utilcore.getuid
 local umask   = utilcore.umask
 
 local upgrade  = require "clydelib.upgrade"
+local async    = require "clydelib.async"
+local cache    = require "clydelib.cache"
+local pkgdestindex = require "clydelib.pkgdest"
+local archive  = require "clydelib.archive"
 
 local ssl = require "ssl"
 -- credit for params and create goes to James McLaughlin
+local DEFAULT_CAFILE = "/etc/ssl/certs/ca-certificates.crt"
 local params = {
     mode = "client",
     protocol = "sslv23",
-    cafile = "/etc/ssl/certs/ca-certificates.crt",
+    cafile = DEFAULT_CAFILE,
     verify = "peer",
     options = "all",
 }
 
-local AURURI    = "http://aur.archlinux.org:443"
-local PBURIFMT  = AURURI .. "/packages/%s/PKGBUILD"
-local PKGURIFMT = AURURI .. "/packages/%s/%s.tar.gz"
+-- AurUrl and AurCAFile in clyde.conf point us at another AUR, like the
+-- mock server in extras/aurmock.
+local DEFAULT_AURURI = "https://aur.archlinux.org"
+local PBPATHFMT      = "/packages/%s/PKGBUILD"
+local PKGPATHFMT     = "/packages/%s/%s.tar.gz"
+
+-- Returns the URI of path on the AUR web site.
+function aururi ( path )
+    local base = ( config.aur_url or DEFAULT_AURURI ):gsub( "/+$", "" )
+    return base .. path
+end
 
 function srcpkguri ( pkgname )
-    return string.format( PKGURIFMT, pkgname, pkgname )
+    return aururi( string.format( PKGPATHFMT, pkgname, pkgname ))
 end
 
 function pkgbuilduri ( pkgname )
-    return string.format( PBURIFMT, pkgname )
+    return aururi( string.format( PBPATHFMT, pkgname ))
 end
 
--- Create a URI for RPC calls
-local VALID_RPC_METHOD = { search = true, info = true, msearch = true }
+-- Create a URI for RPC calls. For multiinfo, arg is a list of names.
+local VALID_RPC_METHOD = { search = true, info = true, msearch = true,
+                           multiinfo = true }
 function rpcuri ( method, arg )
     if not method or not VALID_RPC_METHOD[ method ] then
         error( method .. " is not a valid AUR RPC method" )
     end
 
-    return AURURI .. "/rpc.php?type=" .. method .. "&arg=" .. arg
+    local uri = aururi( "/rpc.php?type=" .. method )
+    if type( arg ) == "table" then
+        for i, name in ipairs( arg ) do
+            uri = uri .. "&arg[]=" .. url.escape( name )
+        end
+        return uri
+    end
+
+    return uri .. "&arg=" .. url.escape( arg )
 end
 
 function get_builduser()
@@ -74,31 +97,547 @@ function get_builddir ()
     return config.builddir or "/tmp/clyde-" .. get_builduser().name
 end
 
-local try = socket.try
-local protect = socket.protect
-function create_socket()
-    local t = {c=try(socket.tcp())}
+-- HTTP ----------------------------------------------------------------------
+
+--[[ socket.http sends "Connection: close" and throws its socket away
+     after every request, so each RPC call used to pay for a new TCP
+     connection and a full TLS handshake. We speak just enough HTTP/1.1
+     here to keep connections open and hand them to the next request
+     for the same host. ]]--
+
+local BLOCKSIZE     = 8192
+local MAX_IDLE      = 4  -- idle connections kept per host, at least
+                         -- as many as requests we may run at once
+local MAX_REDIRECTS = 5
+
+-- Counters shown by print_netstats() under --debug.
+netstats = { requests = 0, connects = 0, handshakes = 0, reused = 0,
+             stale = 0, pipelined = 0, hedged = 0, hedgewins = 0 }
+
+--[[ Latency samples, in seconds, are kept per kind of request: the
+     time to the first byte of the response to RPC requests, and the
+     time whole requests took. print_netstats() shows them as histograms
+     under --debug and the RPC ones decide when a request is hedged. ]]--
+
+local MAX_SAMPLES       = 1000
+local HEDGE_MIN_SAMPLES = 10   -- samples needed before we hedge
+local HEDGE_MIN_DELAY   = 0.05 -- seconds, never hedge sooner than this
+local HIST_BOUNDS       = { 10, 25, 50, 100, 250, 500, 1000, 2500, 5000,
+                            10000 } -- ms
+
+latency = { rpc = { n = 0 }, request = { n = 0 } }
+
+local function add_sample ( kind, seconds )
+    local samples = latency[ kind ]
+    -- Once full the oldest samples are overwritten.
+    samples.n = samples.n + 1
+    samples[ ( samples.n - 1 ) % MAX_SAMPLES + 1 ] = seconds
+end
 
-    function idx (tbl, key)
-        --print("idx " .. key)
-        return function (prxy, ...)
-                   local c = prxy.c
-                   return c[key](c,...)
-               end
+-- Returns the p-th percentile (0 < p <= 1) of a kind of samples.
+local function percentile ( kind, p )
+    local sorted = {}
+    for i, t in ipairs( latency[ kind ] ) do sorted[i] = t end
+    if #sorted == 0 then return nil end
+    table.sort( sorted )
+    return sorted[ math.ceil( p * #sorted ) ]
+end
+
+-- How long to wait for an answer before hedging, or nil to not hedge.
+local function hedge_delay ()
+    if config.aur_nohedge or #latency.rpc < HEDGE_MIN_SAMPLES then
+        return nil
     end
+    return math.max( percentile( "rpc", 0.95 ), HEDGE_MIN_DELAY )
+end
 
-    function t:connect(host, port)
-        --print ("proxy connect ", host, port)
-        try(self.c:connect(host, port))
-        --print ("connected")
-        self.c = try(ssl.wrap(self.c,params))
-        --print("wrapped")
-        try(self.c:dohandshake())
-        --print("handshaked")
-        return 1
+local idle_conns = {} -- "host:port" => list of idle connections
+
+local function conn_key ( host, port )
+    return host .. ":" .. port
+end
+
+local function open_conn ( scheme, host, port )
+    local sock = socket.tcp()
+    local ok, err = async.connect( sock, host, port )
+    if not ok then
+        sock:close()
+        return nil, string.format( "connect to %s:%d failed: %s",
+                                   host, port, err )
+    end
+    netstats.connects = netstats.connects + 1
+
+    if scheme == "https" then
+        params.cafile = config.aur_cafile or DEFAULT_CAFILE
+        sock, err = ssl.wrap( sock, params )
+        if not sock then return nil, err end
+        if sock.sni then sock:sni( host ) end
+
+        ok, err = async.handshake( sock )
+        if not ok then
+            sock:close()
+            return nil, "TLS handshake with " .. host .. " failed: " .. err
+        end
+        netstats.handshakes = netstats.handshakes + 1
+    end
+
+    return { sock = sock; host = host; port = port;
+             key  = conn_key( host, port ); nreqs = 0 }
+end
+
+-- An idle connection that has become readable was closed by the
+-- server (or has garbage pending) and must not be reused.
+local function conn_is_stale ( conn )
+    local ready = socket.select( { conn.sock }, nil, 0 )
+    return next( ready ) ~= nil
+end
+
+local function checkout_conn ( scheme, host, port )
+    local idle = idle_conns[ conn_key( host, port ) ]
+    while idle and #idle > 0 do
+        local conn = table.remove( idle )
+        if not conn_is_stale( conn ) then
+            netstats.reused = netstats.reused + 1
+            return conn, true
+        end
+        netstats.stale = netstats.stale + 1
+        conn.sock:close()
+    end
+
+    local conn, err = open_conn( scheme, host, port )
+    return conn, false, err
+end
+
+local function checkin_conn ( conn )
+    local idle = idle_conns[ conn.key ]
+    if not idle then
+        idle = {}
+        idle_conns[ conn.key ] = idle
+    end
+
+    if #idle >= math.max( MAX_IDLE, async.concurrency()) then
+        conn.sock:close()
+    else
+        table.insert( idle, conn )
+    end
+end
+
+-- Close every idle connection in the pool.
+function close_conns ()
+    for key, idle in pairs( idle_conns ) do
+        for i, conn in ipairs( idle ) do conn.sock:close() end
+        idle_conns[ key ] = nil
+    end
+end
+
+-- Splits a URL into the pieces we need to make a request.
+local function split_url ( uri )
+    local parsed = url.parse( uri )
+    if not parsed or not parsed.host then
+        return nil, "invalid URL: " .. tostring( uri )
+    end
+
+    local scheme = parsed.scheme or "http"
+    local port   = tonumber( parsed.port )
+        or ( scheme == "https" and 443 or 80 )
+    local target = parsed.path or "/"
+    if parsed.query then target = target .. "?" .. parsed.query end
+
+    return { scheme = scheme; host = parsed.host; port = port;
+             target = target }
+end
+
+local function send_request ( conn, req, target )
+    local lines = { string.format( "%s %s HTTP/1.1",
+                                   req.method or "GET", target ),
+                    "Host: " .. conn.host,
+                    "User-Agent: clyde",
+                    "Connection: keep-alive" }
+    for name, value in pairs( req.headers or {} ) do
+        table.insert( lines, name .. ": " .. value )
+    end
+    table.insert( lines, "\r\n" )
+
+    return async.send( conn.sock, table.concat( lines, "\r\n" ))
+end
+
+-- Reads the body of a response and pumps it into sink. Returns true
+-- if the connection may be used again afterwards. A sink which returns
+-- nil (and a message) stops the transfer; the connection is then closed.
+local function receive_body ( conn, headers, sink )
+    local sock = conn.sock
+    local data, err
+
+    if ( headers[ "transfer-encoding" ] or "" ):lower():match( "chunked" ) then
+        while true do
+            local line, err = async.receive( sock, "*l" )
+            if not line then return nil, err end
+
+            local size = tonumber( line:match( "^%s*(%x+)" ), 16 )
+            if not size then return nil, "bad chunk size: " .. line end
+            if size == 0 then break end
+
+            while size > 0 do
+                local partial
+                data, err, partial = async.receive( sock,
+                                                    math.min( size, BLOCKSIZE ))
+                if not data then
+                    if partial and #partial > 0 then sink( partial ) end
+                    return nil, err
+                end
+                local ok, sinkerr = sink( data )
+                if not ok then return nil, sinkerr end
+                size = size - #data
+            end
+            async.receive( sock, "*l" ) -- CRLF after the chunk data
+        end
+
+        -- Skip any trailers...
+        repeat
+            data, err = async.receive( sock, "*l" )
+            if not data then return nil, err end
+        until data == ""
+
+        return true
+    end
+
+    local length = tonumber( headers[ "content-length" ] )
+    if length then
+        while length > 0 do
+            local partial
+            data, err, partial = async.receive( sock,
+                                                math.min( length, BLOCKSIZE ))
+            if not data then
+                -- Keep what we got, a download can be resumed from there.
+                if partial and #partial > 0 then sink( partial ) end
+                return nil, err
+            end
+            local ok, sinkerr = sink( data )
+            if not ok then return nil, sinkerr end
+            length = length - #data
+        end
+        return true
+    end
+
+    -- No length given, the body ends when the server closes the connection.
+    while true do
+        local partial
+        data, err, partial = async.receive( sock, BLOCKSIZE )
+        data = data or partial
+        if data and #data > 0 then
+            local ok, sinkerr = sink( data )
+            if not ok then return nil, sinkerr end
+        end
+        if err == "closed" then return false end
+        if err then return nil, err end
+    end
+end
+
+-- Wraps sink so that a gzip-encoded body is inflated before it reaches it.
+local function gunzip_sink ( sink )
+    local chunks = {}
+    return function ( chunk )
+        if chunk then
+            table.insert( chunks, chunk )
+            return 1
+        end
+
+        if #chunks > 0 then
+            local inflated = zlib.inflate( table.concat( chunks ))
+            sink( inflated:read( "*a" ))
+        end
+        return sink( nil )
+    end
+end
+
+-- Reads a response from conn, returns the status code and a table of
+-- headers, with their names lowercased. The second result is true if
+-- any of the body was given to the sink.
+local function receive_response ( conn, req )
+    local sock = conn.sock
+    local line, err, code, headers
+
+    repeat
+        line, err = async.receive( sock, "*l" )
+        if not line then return nil, err end
+
+        code = tonumber( line:match( "^HTTP/%d%.%d (%d%d%d)" ))
+        if not code then return nil, "bad HTTP status line: " .. line end
+        local version = line:match( "^HTTP/(%d%.%d)" )
+
+        headers = {}
+        while true do
+            line, err = async.receive( sock, "*l" )
+            if not line then return nil, err end
+            if line == "" then break end
+
+            local name, value = line:match( "^([^:]+):%s*(.-)%s*$" )
+            if name then headers[ name:lower() ] = value end
+        end
+
+        conn.keepalive = ( version == "1.1" and
+                           ( headers.connection or "" ):lower() ~= "close" )
+    until code >= 200 -- skip "100 Continue" and friends
+
+    local bodyless = ( req.method == "HEAD" or code == 204 or code == 304 )
+    local sink     = req.sink or ltn12.sink.null()
+    if req.redirect ~= false and headers.location
+        and code >= 301 and code <= 308 then
+        sink = ltn12.sink.null()
+    elseif req.onresponse and not req.onresponse( code, headers ) then
+        -- The caller does not want this body.
+        sink = ltn12.sink.null()
+    elseif not bodyless
+        and ( headers[ "content-encoding" ] or "" ):match( "gzip" ) then
+        sink = gunzip_sink( sink )
+    end
+
+    if not bodyless then
+        local reusable
+        reusable, err = receive_body( conn, headers, sink )
+        if reusable == nil then return nil, err, true end
+        if not reusable then conn.keepalive = false end
+    end
+    sink( nil )
+
+    return code, headers
+end
+
+--[[ Waits for the answer to req to start arriving on conn, for at most
+     the read timeout. Requests which may be sent twice set req.hedge:
+     if their answer takes longer than the 95th percentile of the ones
+     before, the request is sent again on another connection and we use
+     whichever connection answers first. The other one is closed.
+     Returns the connection to read the response from. ]]--
+local function await_response ( conn, req, u )
+    if not req.hedge then return conn end
+
+    local started = socket.gettime()
+    local delay   = hedge_delay()
+    local ready   = async.select_readable( { conn.sock },
+                                           delay or async.read_timeout())
+    if not ready and delay then
+        local other = checkout_conn( u.scheme, u.host, u.port )
+        if other and send_request( other, req, u.target ) then
+            netstats.hedged = netstats.hedged + 1
+            lprintf( "LOG_DEBUG", "aur: no answer after %d ms, hedging %s\n",
+                     delay * 1000, u.target )
+
+            local left = async.read_timeout() - ( socket.gettime() - started )
+            ready = async.select_readable( { conn.sock, other.sock },
+                                           math.max( left, 0 ))
+            if ready == other.sock then
+                netstats.hedgewins = netstats.hedgewins + 1
+                conn.sock:close()
+                conn = other
+            else
+                other.sock:close()
+            end
+        elseif other then
+            other.sock:close()
+        end
     end
+    if not ready then return nil, u.host .. " did not answer in time" end
 
-    return setmetatable(t, {__index = idx})
+    add_sample( "rpc", socket.gettime() - started )
+    return conn
+end
+
+-- Makes a single request over one of our pooled connections.
+local function do_request ( req, uri )
+    local u, err = split_url( uri )
+    if not u then return nil, err end
+
+    -- A pooled connection may have been closed by the server after
+    -- we checked it. We can retry once if nothing was received yet.
+    for attempt = 1, 2 do
+        local conn, reused, err = checkout_conn( u.scheme, u.host, u.port )
+        if not conn then return nil, err end
+
+        local code, headers, partial
+        local ok, senderr = send_request( conn, req, u.target )
+        if ok then
+            local ready
+            ready, headers = await_response( conn, req, u )
+            if ready then
+                conn = ready
+                code, headers, partial = receive_response( conn, req )
+            else
+                -- Waiting on the same server again would not help.
+                partial = true
+            end
+        else
+            headers = senderr
+        end
+
+        if code then
+            conn.nreqs = conn.nreqs + 1
+            if conn.keepalive then checkin_conn( conn )
+            else conn.sock:close() end
+            return code, headers
+        end
+
+        conn.sock:close()
+        if not reused or partial then return nil, headers end
+        netstats.stale = netstats.stale + 1
+    end
+
+    return nil, "connection to " .. u.host .. " keeps failing"
+end
+
+--[[ Sends an HTTP request and returns 1, the response code and the
+     response headers on success. On failure, returns nil and an error
+     message. This mirrors socket.http.request's table form:
+     req.url, req.method, req.headers and req.sink are recognized.
+     Set req.redirect to false to not follow redirects. If given,
+     req.onresponse is called with the code and headers of the final
+     response before its body is read. The body is thrown away unless
+     it returns true. Set req.hedge for requests which are safe to send
+     twice, see await_response(). ]]--
+function http_request ( req )
+    netstats.requests = netstats.requests + 1
+
+    local uri = req.url
+    local started = socket.gettime()
+    for hop = 0, MAX_REDIRECTS do
+        local code, headers = do_request( req, uri )
+        if not code then return nil, headers end
+
+        if req.redirect == false or not headers.location
+            or code < 301 or code > 308 then
+            add_sample( "request", socket.gettime() - started )
+            return 1, code, headers
+        end
+
+        uri = url.absolute( uri, headers.location )
+    end
+
+    return nil, "too many redirects for " .. req.url
+end
+
+--[[ Sends a list of GET requests down one connection without waiting
+     for each response in turn. Responses are read back in order and go
+     to each request's sink. Returns a list of { code, headers } or
+     { nil, errmsg } results, one for each request. Requests which were
+     not answered before the connection dropped are retried normally.
+     All requests must be for the same host. ]]--
+function http_pipeline ( reqs )
+    local results = {}
+    if #reqs == 0 then return results end
+
+    if not config.aur_pipeline or #reqs == 1 then
+        for i, req in ipairs( reqs ) do
+            local ok, code, headers = http_request( req )
+            results[i] = { ok and code, ok and headers or code }
+        end
+        return results
+    end
+
+    local u, err = split_url( reqs[1].url )
+    if not u then return { { nil, err } } end
+
+    local conn, reused
+    conn, reused, err = checkout_conn( u.scheme, u.host, u.port )
+
+    local sent = 0
+    if conn then
+        for i, req in ipairs( reqs ) do
+            local target = split_url( req.url ).target
+            if not send_request( conn, req, target ) then break end
+            sent = i
+        end
+    end
+
+    local done = 0
+    for i = 1, sent do
+        local req = reqs[i]
+        netstats.requests  = netstats.requests + 1
+        netstats.pipelined = netstats.pipelined + 1
+
+        local code, headers, partial = receive_response( conn, req )
+        if not code then
+            if partial then results[i] = { nil, headers }; done = i end
+            break
+        end
+
+        results[i] = { code, headers }
+        conn.nreqs = conn.nreqs + 1
+        done = i
+
+        -- We cannot follow redirects in the middle of a pipeline.
+        if headers.location and code >= 301 and code <= 308
+            and req.redirect ~= false then
+            results[i] = nil
+            done = i - 1
+            break
+        end
+        if not conn.keepalive then break end
+    end
+
+    if conn then
+        if done == sent and conn.keepalive then checkin_conn( conn )
+        else conn.sock:close() end
+    end
+
+    -- Anything left over gets a request of its own.
+    for i = done + 1, #reqs do
+        local ok, code, headers = http_request( reqs[i] )
+        results[i] = { ok and code, ok and headers or code }
+    end
+
+    return results
+end
+
+-- Logs a histogram of one kind of latency samples.
+local function print_latency ( kind, title )
+    local samples = latency[ kind ]
+    if #samples == 0 then return end
+
+    local counts = {}
+    for i, t in ipairs( samples ) do
+        local ms, bucket = t * 1000, #HIST_BOUNDS + 1
+        for j, bound in ipairs( HIST_BOUNDS ) do
+            if ms < bound then bucket = j; break end
+        end
+        counts[ bucket ] = ( counts[ bucket ] or 0 ) + 1
+    end
+
+    lprintf( "LOG_DEBUG", "aur: %s latency of %d requests: p50 %d ms, "
+                 .. "p95 %d ms, p99 %d ms\n", title, #samples,
+             percentile( kind, 0.5 ) * 1000, percentile( kind, 0.95 ) * 1000,
+             percentile( kind, 0.99 ) * 1000 )
+    for j = 1, #HIST_BOUNDS + 1 do
+        if counts[j] then
+            local label = HIST_BOUNDS[j]
+                and string.format( "< %5d ms", HIST_BOUNDS[j] )
+                or string.format( ">=%5d ms", HIST_BOUNDS[ #HIST_BOUNDS ] )
+            lprintf( "LOG_DEBUG", "aur:   %s %5d %s\n", label, counts[j],
+                     string.rep( "#", math.ceil( 40 * counts[j] / #samples )))
+        end
+    end
+end
+
+function print_netstats ()
+    local s = netstats
+    lprintf( "LOG_DEBUG",
+             "aur: %d requests, %d connections, %d TLS handshakes, "
+                 .. "%d reused, %d stale, %d pipelined\n",
+             s.requests, s.connects, s.handshakes, s.reused,
+             s.stale, s.pipelined )
+    lprintf( "LOG_DEBUG", "aur: %d requests hedged, %d won by the hedge\n",
+             s.hedged, s.hedgewins )
+    print_latency( "rpc", "RPC first byte" )
+    print_latency( "request", "request" )
+
+    s = rpcstats
+    lprintf( "LOG_DEBUG",
+             "aur: RPC cache %d hits, %d misses, %d revalidated\n",
+             s.hits, s.misses, s.revalidated )
+
+    s = srcpkgstats
+    lprintf( "LOG_DEBUG",
+             "aur: source package cache %d hits, %d misses, %d revalidated\n",
+             s.hits, s.misses, s.revalidated )
 end
 
 function chown_builduser ( path, ... )
@@ -121,9 +660,7 @@ function make_builddir ( pkgname )
 end
 
 function get_content_length ( uri )
-    local r, c, h = http.request {
-        method = "HEAD", url = uri, create = create_socket,
-    }
+    local r, c, h = http_request { method = "HEAD", url = uri }
     if c ~= 200 then return nil
     else return h['content-length'] end
 end
@@ -149,19 +686,108 @@ local function aur_rpc_keyname ( key )
     return NEWKEYNAME_FOR[ key ] or key:lower()
 end
 
-function rpc_info ( name )
-    local url    = rpcuri( "info", name )
-    local chunks = {}
-    local ret, code = http.request { url    = url,
-                                     create = create_socket,
-                                     sink   = ltn12.sink.table( chunks ) }
-    if not ret or code ~= 200 then
-        error( "HTTP request for info RPC failed: " .. code )
+-- RPC cache -----------------------------------------------------------------
+
+--[[ RPC results are kept on disk in the "rpc" cache subdirectory, keyed
+     by the AUR they came from, method and argument (see rpc_key). Entries
+     younger than RpcCacheTTL seconds are used as they are. Older ones
+     are revalidated with If-None-Match or If-Modified-Since if the AUR
+     gave us an ETag or Last-Modified header for them. With --offline
+     every cached entry is used, however old, and the AUR is not asked. ]]--
+
+local DEFAULT_RPC_TTL = 600
+
+-- Counters shown by print_netstats() under --debug.
+rpcstats = { hits = 0, misses = 0, revalidated = 0 }
+
+local function rpc_fresh ( entry )
+    local ttl = config.rpc_cache_ttl or DEFAULT_RPC_TTL
+    return config.offline or os.time() - entry.fetched < ttl
+end
+
+-- Returns the cache key for method and arg on the AUR we talk to, like
+-- "<hash of the AUR's URI>:info:clyde", so that answers from another
+-- AurUrl are never used.
+local function rpc_key ( method, arg )
+    return utilcore.strhash( aururi( "" )) .. ":" .. method .. ":" .. arg
+end
+
+local function rpc_store ( key, value, headers )
+    headers = headers or {}
+    cache.store( "rpc", key, { fetched = os.time(),
+                               etag    = headers.etag,
+                               lastmod = headers[ "last-modified" ],
+                               value   = value } )
+end
+
+--[[ Returns the value cached for key or asks the AUR. fetch is called
+     with a table of request headers to send and must return the HTTP
+     code, the response headers and the value to cache (unless the code
+     was 304). The value false is cached for things not on the AUR. ]]--
+local function cached_rpc ( key, fetch )
+    local entry = cache.load( "rpc", key )
+    if entry and rpc_fresh( entry ) then
+        rpcstats.hits = rpcstats.hits + 1
+        return entry.value
+    end
+
+    if config.offline then
+        rpcstats.misses = rpcstats.misses + 1
+        error( "AUR RPC " .. key:gsub( "^%x+:", "" )
+               .. " is not cached and we are offline", 0 )
+    end
+
+    local reqheaders = {}
+    if entry and entry.etag then
+        reqheaders[ "If-None-Match" ] = entry.etag
+    end
+    if entry and entry.lastmod then
+        reqheaders[ "If-Modified-Since" ] = entry.lastmod
+    end
+
+    local code, headers, value = fetch( reqheaders )
+    if code == 304 and entry then
+        rpcstats.revalidated = rpcstats.revalidated + 1
+        rpc_store( key, entry.value,
+                   { etag = headers.etag or entry.etag,
+                     [ "last-modified" ] = headers[ "last-modified" ]
+                                           or entry.lastmod } )
+        return entry.value
     end
 
-    local jsontxt = table.concat( chunks, "" )
+    rpcstats.misses = rpcstats.misses + 1
+    rpc_store( key, value, headers )
+    return value
+end
+
+-- RPC -----------------------------------------------------------------------
+
+--[[ RPC responses are parsed as they arrive, the yajl parser is fed each
+     chunk from the socket by this sink. We never hold the whole JSON
+     text in memory and search results can be printed before the rest
+     have arrived. lzlib can only inflate a whole string, so we do not
+     ask for gzip for these requests.
+
+     Parse errors are kept in the returned state table instead of being
+     raised, the body of an HTTP error is not JSON and the HTTP code
+     tells more about what went wrong. The rest of the body is still
+     read, so the connection can be used again. ]]--
+local function parser_sink ( parser )
+    local state = {}
+    local function sink ( chunk )
+        if state.err then return 1 end
+
+        -- A nil chunk completes the parse.
+        local ok, err = pcall( parser, chunk )
+        if not ok then state.err = err end
+        return 1
+    end
+    return sink, state
+end
 
+local function fetch_info ( name, reqheaders )
     local keyname, in_results, results = "", false, {}
+    local rpcerror, message = false, nil
     local parser = yajl.parser {
         events = { open_object = function ( events )
                                      if keyname == "results" then
@@ -174,9 +800,14 @@ function rpc_info ( name )
                    value       = function ( events, value, type )
                                      if keyname == "type" and
                                          value == "error" then
-                                         error( "AUR info RPC failed" )
+                                         rpcerror = true
+                                     end
+                                     if not in_results then
+                                         if keyname == "results" then
+                                             message = value
+                                         end
+                                         return
                                      end
-                                     if not in_results then return end
                                      if keyname == "outdated" then
                                          value = ( value == "1" )
                                      end
@@ -184,40 +815,50 @@ function rpc_info ( name )
                                  end
           }}
 
-    if not pcall( parser, jsontxt ) then return nil end
-    return results
-end
-
-function rpc_search ( query )
-    -- Allow search queries to contain regexp anchors... only!
-    local regexp
-    if query:match( "^^" ) or query:match( "$$" ) then
-        regexp = query
-        regexp = regexp:gsub("([().%+*?[-])", "%%%1")
-        query  = query:gsub( "^^", "" )
-        query  = query:gsub( "$$", "" )
+    local sink, parsed = parser_sink( parser )
+    local ret, code, headers = http_request {
+        url     = rpcuri( "info", name ),
+        headers = reqheaders,
+        hedge   = true,
+        sink    = sink }
+    if not ret or ( code ~= 200 and code ~= 304 ) then
+        error( "HTTP request for info RPC failed: " .. tostring( code ))
     end
-
-    local url    = rpcuri( "search", query )
-    local chunks = {}
-    local ret, code = http.request { url    = url,
-                                     create = create_socket,
-                                     sink   = ltn12.sink.table( chunks ) }
-    if not ret or code ~= 200 then
-        error( "AUR search (" .. query .. ") failed: " .. code )
+    if code == 304 then return code, headers end
+    if parsed.err then error( "AUR info RPC failed: " .. parsed.err ) end
+
+    -- The AUR answers with an error if the package does not exist. Any
+    -- other error (like a rate limit) says nothing about the package
+    -- and must not be cached.
+    if rpcerror then
+        if not tostring( message ):match( "^No results? found" ) then
+            error( "AUR info RPC failed: " .. tostring( message ))
+        end
+        return code, headers, false
     end
+    if not results.name then return code, headers, false end
+    return code, headers, results
+end
 
-    local jsontxt = table.concat( chunks, "" )
-    if not jsontxt then error( "Failed to search AUR using RPC" ) end
-
-    --[[ Create a custom JSON SAX parser. On results with ~1k entries
-         yajl.to_value was bugging out. This is more efficient anyways.
-         We can insert values into our results directly... ]]--
-
-    local results = {}
+function rpc_info ( name )
+    local function fetch ( reqheaders )
+        return fetch_info( name, reqheaders )
+    end
+    return cached_rpc( rpc_key( "info", name ), fetch ) or nil
+end
 
+--[[ Create a custom JSON SAX parser for RPC results which are a list
+     of packages. On results with ~1k entries yajl.to_value was bugging
+     out. This is more efficient anyways. We can insert values into our
+     results directly, which maps package names to info tables.
+     If status is given, the response's type (and the error message
+     when the type is "error") are stored in it. If pkgcb is given it is
+     called with each package's info as soon as it has been parsed. ]]--
+local function rpc_results_parser ( results, status, pkgcb )
+    local status = status or {}
     local in_results, in_pkg, pkgkey, pkginfo = false, false, "", {}
-    local parser = yajl.parser {
+    local topkey = ""
+    return yajl.parser {
         events = { open_array  = function ( evts )
                                      in_results = true
                                  end,
@@ -229,18 +870,29 @@ function rpc_search ( query )
                                          in_results = false
                                      elseif type == "object" and in_pkg then
                                          in_pkg  = false
+                                         if pkgcb then pkgcb( pkginfo ) end
                                          -- Prepare pkginfo for a new
                                          -- package JSON-object entry
                                          pkginfo = {}
                                      end
                                  end,
                    object_key  = function ( evts, name )
-                                     if not in_pkg then return end
+                                     if not in_pkg then
+                                         topkey = name
+                                         return
+                                     end
                                      pkgkey = aur_rpc_keyname( name )
                                  end,
                    -- I think AUR does only string datatypes... heh
                    value       = function ( evts, value, type )
-                                     if not in_pkg then return end
+                                     if not in_pkg then
+                                         if topkey == "type" then
+                                             status.type = value
+                                         elseif topkey == "results" then
+                                             status.message = value
+                                         end
+                                         return
+                                     end
                                      if pkgkey == "name" then
                                          results[ value ] = pkginfo
                                      elseif pkgkey == "outdated" then
@@ -250,77 +902,634 @@ function rpc_search ( query )
                                      pkginfo[ pkgkey ] = value
                                  end
            } }
+end
+
+--[[ Returns a table mapping the names of packages matching query to
+     their info. If pkgcb is given, it is called with the info of each
+     match as it is parsed off the network, or in order of name when
+     the results came from the cache. ]]--
+function rpc_search ( query, pkgcb )
+    -- Allow search queries to contain regexp anchors... only!
+    local regexp
+    if query:match( "^^" ) or query:match( "$$" ) then
+        regexp = query
+        regexp = regexp:gsub("([().%+*?[-])", "%%%1")
+        query  = query:gsub( "^^", "" )
+        query  = query:gsub( "$$", "" )
+    end
+
+    local function matches ( name )
+        return not regexp or name:match( regexp )
+    end
+
+    local streamed = false
+    local function stream ( info )
+        if pkgcb and info.name and matches( info.name ) then pkgcb( info ) end
+    end
 
-    parser( jsontxt )
+    local function fetch ( reqheaders )
+        local results, status = {}, {}
+        local parser  = rpc_results_parser( results, status, stream )
+        local sink, parsed = parser_sink( parser )
+        local ret, code, headers = http_request {
+            url     = rpcuri( "search", query ),
+            headers = reqheaders,
+            hedge   = true,
+            sink    = sink }
+        if not ret or ( code ~= 200 and code ~= 304 ) then
+            error( "AUR search (" .. query .. ") failed: "
+                   .. tostring( code ))
+        end
+        if code == 304 then return code, headers end
+        if parsed.err then
+            error( "AUR search (" .. query .. ") failed: " .. parsed.err )
+        end
+        -- Like for info, only "No results found" may be cached.
+        if status.type == "error"
+            and not tostring( status.message ):match( "^No results? found" ) then
+            error( "AUR search (" .. query .. ") failed: "
+                   .. tostring( status.message ))
+        end
+
+        streamed = true
+        return code, headers, results
+    end
 
-    if not regexp then return results end
+    local results = cached_rpc( rpc_key( "search", query ), fetch )
 
     -- Filter out results if regexp-anchors were given
+    local names = {}
     for name, info in pairs( results ) do
-        if not name:match( regexp ) then
-            results[ name ] = nil
-        end
+        if matches( name ) then table.insert( names, name )
+        else results[ name ] = nil end
+    end
+
+    if pkgcb and not streamed then
+        table.sort( names )
+        for i, name in ipairs( names ) do pkgcb( results[ name ] ) end
     end
 
     return results
 end
 
-------------------------------------------------------------------------------
+-- At most this many names are sent in one multiinfo request, so the
+-- URI stays a sane length.
+local MULTIINFO_MAX = 100
+
+-- Splits names into lists of names for each multiinfo request.
+local function multiinfo_chunks ( names )
+    local chunks, chunk = {}, {}
+    for i, name in ipairs( names ) do
+        table.insert( chunk, name )
+        if #chunk == MULTIINFO_MAX then
+            table.insert( chunks, chunk )
+            chunk = {}
+        end
+    end
+    if #chunk > 0 then table.insert( chunks, chunk ) end
+    return chunks
+end
 
-function download ( pkgname, destdir )
-    local pkgfile = string.format( "%s/%s.src.tar.gz", destdir, pkgname )
+--[[ Looks up info for many packages with as few requests as possible.
+     Returns a table mapping package names to info tables. Names which
+     are not on the AUR are missing from the result. If progresscb is
+     given it is called with the number of names looked up so far and
+     the total number of names after each response is handled. ]]--
+function rpc_multiinfo ( names, progresscb )
+    local found = {}
+    if #names == 0 then return found end
+
+    -- Use the info cached by rpc_info or earlier multiinfo queries. The
+    -- ones which have gone stale are simply fetched again, there is no
+    -- way to revalidate many of them at once.
+    local wanted, uncached = {}, 0
+    for i, name in ipairs( names ) do
+        local entry = cache.load( "rpc", rpc_key( "info", name ))
+        if entry and rpc_fresh( entry ) then
+            rpcstats.hits = rpcstats.hits + 1
+            found[ name ] = entry.value or nil
+        elseif config.offline then
+            rpcstats.misses = rpcstats.misses + 1
+            uncached = uncached + 1
+        else
+            rpcstats.misses = rpcstats.misses + 1
+            table.insert( wanted, name )
+        end
+    end
+
+    if uncached > 0 then
+        lprintf( "LOG_WARNING", "%d packages are not cached and we are "
+                 .. "offline, skipping them\n", uncached )
+    end
+
+    local done = #names - #wanted
+    if #wanted == 0 then
+        if progresscb then progresscb( done, #names ) end
+        return found
+    end
+
+    local chunks = multiinfo_chunks( wanted )
+    local reqs, statuses, parsed = {}, {}, {}
+    for i, chunk in ipairs( chunks ) do
+        statuses[i] = {}
+        local parser = rpc_results_parser( found, statuses[i] )
+        local sink
+        sink, parsed[i] = parser_sink( parser )
+        reqs[i] = { url = rpcuri( "multiinfo", chunk ), hedge = true,
+                    sink = sink }
+    end
+
+    local function handle ( i, code, err )
+        if code ~= 200 then
+            error( "AUR multiinfo RPC failed: " .. tostring( code or err ))
+        end
+
+        if parsed[i].err then
+            error( "AUR multiinfo RPC failed: " .. parsed[i].err )
+        end
+
+        local status = statuses[i]
+        if status.type == "error" then
+            error( "AUR multiinfo RPC failed: " .. tostring( status.message ))
+        end
 
+        for j, name in ipairs( chunks[i] ) do
+            rpc_store( rpc_key( "info", name ), found[ name ] or false )
+        end
+
+        done = done + #chunks[i]
+        if progresscb then progresscb( done, #names ) end
+    end
+
+    -- Either send every request down one connection or make them all
+    -- at once over several connections.
+    if config.aur_pipeline then
+        for i, result in ipairs( http_pipeline( reqs )) do
+            handle( i, result[1], result[2] )
+        end
+        return found
+    end
+
+    local fetchers = {}
+    for i, req in ipairs( reqs ) do
+        fetchers[i] = function ()
+                          local ok, code = http_request( req )
+                          handle( i, ok and code, code )
+                      end
+    end
+    async.all( fetchers )
+
+    return found
+end
+
+-- Downloads -----------------------------------------------------------------
+
+local HTTP_DAYS   = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" }
+local HTTP_MONTHS = { "Jan", "Feb", "Mar", "Apr", "May", "Jun",
+                      "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" }
+
+-- Formats time for HTTP headers. os.date would use the locale's names.
+local function http_date ( time )
+    local t = os.date( "!*t", time )
+    return string.format( "%s, %02d %s %04d %02d:%02d:%02d GMT",
+                          HTTP_DAYS[ t.wday ], t.day, HTTP_MONTHS[ t.month ],
+                          t.year, t.hour, t.min, t.sec )
+end
+
+-- Returns the value to send as If-Range for a response with headers:
+-- its strong ETag or else its Last-Modified, or nil.
+local function range_validator ( headers )
+    local etag = headers.etag
+    if etag and not etag:match( "^W/" ) then return etag end
+    return headers[ "last-modified" ]
+end
+
+-- Reads the validator saved with a .part file, or returns nil.
+local function load_validator ( path )
+    local fh = io.open( path, "r" )
+    if not fh then return nil end
+    local validator = fh:read( "*l" )
+    fh:close()
+    return validator ~= "" and validator or nil
+end
+
+-- Saves validator with a .part file, or removes the old one if it is nil.
+local function save_validator ( path, validator )
+    if not validator then
+        os.remove( path )
+        return
+    end
     local oldmask = umask( "0133" )
-    local pkgfh, err = io.open( pkgfile, "w" )
-    assert( pkgfh, err )
+    local fh = io.open( path, "w" )
+    umask( oldmask )
+    if fh then
+        fh:write( validator, "\n" )
+        fh:close()
+    end
+end
+
+--[[ Downloads uri to destfile. The data is written to destfile .. ".part"
+     which is only renamed to destfile once it is complete. If a .part
+     file was left behind by an interrupted download, we ask the server
+     for the rest of it with a Range request and append to it. The ETag
+     or Last-Modified of the response it came from is kept in a
+     .part.validator file and sent as If-Range, so that a file which
+     changed since is sent whole. Without one the .part file is not used.
+
+     opts may contain:
+     since    - only download if the file changed since this time
+     headers  - more request headers, ie If-None-Match
+     progress - called with the bytes received so far and the total size
+                (or -1 if unknown), starting with 0
+     verify   - called with the path of the complete .part file, returns
+                nil and a message if the file is no good
+
+     Returns the HTTP code (200, 206 or 304) and the response headers, or
+     nil and an error message. The .part file is kept after a network
+     error, so we can resume. ]]--
+function http_download ( uri, destfile, opts )
+    local opts     = opts or {}
+    local partfile = destfile .. ".part"
+    local valfile  = partfile .. ".validator"
+    local offset   = lfs.attributes( partfile, "size" ) or 0
+    local validator = offset > 0 and load_validator( valfile )
+    if not validator then offset = 0 end
+
+    for attempt = 1, 2 do
+        local headers = {}
+        for name, value in pairs( opts.headers or {} ) do
+            headers[ name ] = value
+        end
+        if offset > 0 then
+            headers.Range        = "bytes=" .. offset .. "-"
+            headers[ "If-Range" ] = validator
+        end
+        if opts.since then
+            headers[ "If-Modified-Since" ] = http_date( opts.since )
+        end
+
+        local fh, total, xfered
+        local function onresponse ( code, resheaders )
+            local mode
+            if code == 206 then
+                local start, size = ( resheaders[ "content-range" ] or "" )
+                    :match( "^bytes (%d+)%-%d+/(%d*)" )
+                if tonumber( start ) ~= offset then return false end
+                total, mode = tonumber( size ), "ab"
+            elseif code == 200 then
+                -- The server ignored our Range, or the file changed since
+                -- our .part was written: start over.
+                offset = 0
+                total, mode = tonumber( resheaders[ "content-length" ] ), "wb"
+            else
+                return false
+            end
+
+            -- Other downloads may change the umask while we wait for data.
+            local oldmask = umask( "0133" )
+            fh = io.open( partfile, mode )
+            umask( oldmask )
+            if not fh then return false end
+            if mode == "wb" then
+                save_validator( valfile, range_validator( resheaders ))
+            end
+
+            xfered = offset
+            if opts.progress then
+                opts.progress( 0, total or -1 )
+                if xfered > 0 then opts.progress( xfered, total or -1 ) end
+            end
+            return true
+        end
+
+        local function sink ( chunk )
+            if chunk and fh then
+                fh:write( chunk )
+                xfered = xfered + #chunk
+                if opts.progress then opts.progress( xfered, total or -1 ) end
+            end
+            return 1
+        end
+
+        local ok, code, resheaders = http_request { url        = uri,
+                                                    headers    = headers,
+                                                    sink       = sink,
+                                                    onresponse = onresponse }
+        if fh then fh:close() end
+        if not ok then return nil, code end
+
+        if code == 304 then return code, resheaders end
+        if code == 416 and offset > 0 then
+            -- Our .part file is no part of what the server has now.
+            os.remove( partfile )
+            os.remove( valfile )
+            offset = 0
+        elseif not fh then
+            return nil, string.format( "%s: HTTP %d", uri, code )
+        else
+            local size = lfs.attributes( partfile, "size" )
+            if total and size ~= total then
+                return nil, string.format( "%s: received %d of %d bytes",
+                                           uri, size or 0, total )
+            end
+            if opts.verify then
+                local good, err = opts.verify( partfile )
+                if not good then
+                    os.remove( partfile )
+                    os.remove( valfile )
+                    return nil, err
+                end
+            end
+
+            local moved, err = os.rename( partfile, destfile )
+            if not moved then return nil, err end
+            os.remove( valfile )
+            return code, resheaders
+        end
+    end
+
+    return nil, uri .. ": cannot resume download"
+end
+
+-- Reads through the archive at path, to check it is complete.
+local function check_archive ( path )
+    local fh, err = io.open( path, "rb" )
+    if not fh then return nil, err end
+
+    local ok, err = pcall( function ()
+        local reader = archive.open( function () return fh:read( BLOCKSIZE ) end )
+        while reader:next() do end
+        reader:close()
+    end )
+    fh:close()
+
+    if not ok then return nil, path .. ": " .. tostring( err ) end
+    return true
+end
+
+--[[ Source tarballs are kept in the "srcpkg" cache subdirectory along
+     with the ETag and Last-Modified the AUR sent with them. They are
+     fetched again with a conditional GET, which costs no more than the
+     response headers when the tarball did not change. The cache is
+     shared by every build user and build dir. If we cannot write to the
+     cache, tarballs go straight to the build dir as before. ]]--
+
+srcpkgstats = { hits = 0, misses = 0, revalidated = 0 }
+
+local function srcpkg_cache_path ( pkgname )
+    return cache.subdir_path( "srcpkg" ) .. "/" .. url.escape( pkgname )
+        .. ".src.tar.gz"
+end
+
+-- Returns the path of an up to date copy of pkgname's source tarball in
+-- the cache, or nil if the cache cannot be written to.
+local function cached_srcpkg ( pkgname )
+    local path = srcpkg_cache_path( pkgname )
+    local meta = cache.load( "srcpkg", pkgname )
+    local have = meta and lfs.attributes( path, "mode" ) == "file"
+
+    if config.offline then
+        if have then
+            srcpkgstats.hits = srcpkgstats.hits + 1
+            return path
+        end
+        error( "the source package of " .. pkgname
+               .. " is not cached and we are offline", 0 )
+    end
+    if not cache.writable( "srcpkg" ) then return nil end
+
+    local headers = {}
+    if have then
+        headers[ "If-None-Match" ]     = meta.etag
+        headers[ "If-Modified-Since" ] = meta.lastmod
+    end
+
+    local code, resheaders = http_download( srcpkguri( pkgname ), path,
+                                            { headers = headers,
+                                              verify  = check_archive } )
+    if not code then
+        error( "download of " .. pkgname .. " failed: "
+               .. tostring( resheaders ), 0 )
+    end
+    if code == 304 and have then
+        srcpkgstats.revalidated = srcpkgstats.revalidated + 1
+        return path
+    elseif code == 304 then
+        error( "download of " .. pkgname .. " failed: unexpected 304", 0 )
+    end
+
+    srcpkgstats.misses = srcpkgstats.misses + 1
+    cache.store( "srcpkg", pkgname, { etag    = resheaders.etag,
+                                      lastmod = resheaders[ "last-modified" ],
+                                      time    = os.time() } )
+    return path
+end
+
+-- Returns a function which reads the file at path chunk by chunk, for
+-- extract_srcpkg. The file is closed at its end.
+local function read_file ( path )
+    local fh = assert( io.open( path, "rb" ))
+    return function ()
+        if not fh then return nil end
+        local chunk = fh:read( BLOCKSIZE )
+        if not chunk then fh:close(); fh = nil end
+        return chunk
+    end
+end
+
+function download ( pkgname, destdir )
+    local pkgfile = string.format( "%s/%s.src.tar.gz", destdir, pkgname )
 
     print( C.greb("==>") .. C.bright( " Downloading " .. pkgname .. "..."))
-    assert( http.request { url    = srcpkguri( pkgname ),
-                           create = create_socket,
-                           sink   = ltn12.sink.file( pkgfh ) } );
+    local cached = cached_srcpkg( pkgname )
+    if not cached then
+        assert( http_download( srcpkguri( pkgname ), pkgfile,
+                               { verify = check_archive } ))
+        return pkgfile
+    end
+
+    -- Copy it, the build dir belongs to the build user.
+    local oldmask = umask( "0133" )
+    local out, err = io.open( pkgfile, "wb" )
+    umask( oldmask )
+    assert( out, err )
+    for chunk in read_file( cached ) do out:write( chunk ) end
+    out:close()
 
-    umask( oldmask );
     return pkgfile
 end
 
 function getgzip ( geturl )
     local sinktbl = {}
 
-    local r, e = http.request {
+    -- The body is inflated for us if the server did gzip it.
+    local r, e = http_request {
         url     = geturl;
         sink    = ltn12.sink.table(sinktbl);
         headers = { ["Accept-Encoding"] = "gzip" };
-        create  = create_socket;
     }
     if (e ~= 200) then
         return nil
     end
-    local inflated = zlib.inflate(table.concat(sinktbl))
-    return inflated:read("*a")
+    return table.concat(sinktbl)
+end
+
+--[[ Extracts a source package into destdir with libarchive. readfn is
+     called for each chunk of the tarball and returns nil at the end.
+     Every entry goes through reader:extract(), which refuses to write
+     outside of destdir. The PKGBUILD and any .install files are read
+     back once the whole tarball is extracted, so we get what makepkg
+     will. Returns a table mapping their names to their text. ]]--
+local function extract_srcpkg ( readfn, destdir )
+    local reader, paths, texts = archive.open( readfn ), {}, {}
+
+    local ok, err = pcall( function ()
+        while true do
+            local path, kind = reader:next()
+            if not path then break end
+
+            local name = kind == "file" and
+                ( path:match( "^[^/]+/(PKGBUILD)$" )
+                  or path:match( "^[^/]+/([^/]+%.install)$" ))
+            if name then paths[ name ] = destdir .. "/" .. path end
+            reader:extract( destdir )
+        end
+    end )
+    reader:close()
+    if not ok then error( err, 0 ) end
+
+    for name, path in pairs( paths ) do
+        -- A later entry could have replaced it or its directory with
+        -- something else.
+        if lfs.symlinkattributes( path:match( "^(.*)/" ), "mode" ) ~= "directory"
+            or lfs.symlinkattributes( path, "mode" ) ~= "file" then
+            error( path .. " is not a regular file", 0 )
+        end
+        local fh = assert( io.open( path, "rb" ))
+        texts[ name ] = fh:read( "*a" )
+        fh:close()
+    end
+    return texts
 end
 
+--[[ Returns a function which returns the body of a GET for uri chunk by
+     chunk, suited for extract_srcpkg. The request runs in a coroutine
+     which is resumed each time libarchive wants more. After the body is
+     read the HTTP code is checked.
+
+     The second function returned gives up on the rest of the body: the
+     request is stopped and its connection closed. ]]--
+local function stream_body ( uri )
+    local function get ()
+        local ok, code = http_request {
+            url        = uri,
+            onresponse = function ( code ) return code == 200 end,
+            sink       = function ( chunk )
+                             if chunk and not coroutine.yield( chunk ) then
+                                 return nil, "cancelled"
+                             end
+                             return 1
+                         end }
+        if not ok or code ~= 200 then
+            error( "download of " .. uri .. " failed: " .. tostring( code ),
+                   0 )
+        end
+    end
+
+    local co = coroutine.create( get )
+    local function read ()
+        if coroutine.status( co ) == "dead" then return nil end
+        local ok, chunk = coroutine.resume( co, true )
+        if not ok then error( chunk, 0 ) end
+        return chunk
+    end
+    local function cancel ()
+        if coroutine.status( co ) == "suspended" then
+            coroutine.resume( co, false )
+        end
+    end
+    return read, cancel
+end
+
+--[[ Downloads the source package for pkgname and extracts it into destdir,
+     from the source package cache or else without writing the tarball to
+     disk. Returns the extracted directory and a table with the text of
+     its PKGBUILD and .install files. ]]--
 function download_extract ( pkgname, destdir )
-    local pkgpath = download( pkgname, destdir )
-    local pkgfile = pkgpath:gsub( "^.*/", "" )
+    local uri = srcpkguri( pkgname )
+    print( C.greb("==>") .. C.bright( " Downloading " .. pkgname .. "..."))
+
+    local readfn, cancel
+    local cached = cached_srcpkg( pkgname )
+    if cached then
+        readfn = read_file( cached )
+    elseif async.current() then
+        -- libarchive cannot wait for a task to be resumed from inside of
+        -- its read callback, so inside of a task we download the whole
+        -- tarball into memory first.
+        local chunks = {}
+        local ok, code = http_request { url  = uri,
+                                        sink = ltn12.sink.table( chunks ) }
+        if not ok or code ~= 200 then
+            error( "download of " .. uri .. " failed: " .. tostring( code ),
+                   0 )
+        end
+
+        local i = 0
+        readfn = function () i = i + 1; return chunks[i] end
+    else
+        readfn, cancel = stream_body( uri )
+    end
 
     local oldumask = umask( "0022" )
-    local cmdfmt = "bsdtar -x --file '%s'"
-        .. " --no-same-owner --no-same-permissions"
-        .. " --directory '%s'"
-    local cmdline = string.format( cmdfmt, pkgpath, destdir )
-    if os.execute( cmdline ) ~= 0 then
-        error( "bsdtar failed to extract " .. pkgpath, 0 )
+    local ok, texts = pcall( extract_srcpkg, readfn, destdir )
+    umask( oldumask )
+    if not ok then
+        if cancel then cancel() end
+        error( "failed to extract " .. pkgname .. ": " .. texts, 0 )
     end
 
+    -- libarchive stops reading at the end of the tar data, read whatever
+    -- is left so that the connection can be reused.
+    while readfn() do end
+
     -- Return the path to the directory that was (hopefully) extracted
     local extdir = destdir .. "/" .. pkgname
     if not pcall( lfs.dir, extdir ) then
         error( extdir .. " was not extracted", 0 )
     end
 
-    umask( oldumask )
+    return extdir, texts
+end
+
+--[[ Async variants of the functions above. Each one starts a task to
+     make its requests and returns it. Tasks run when async.run() is
+     called. callback is optional and is given what pcall would return
+     for the blocking function. ]]--
+local function spawn ( callback, fn, ... )
+    local task = async.spawn( fn, ... )
+    task.callback = callback
+    return task
+end
+
+function rpc_info_async ( name, callback )
+    return spawn( callback, rpc_info, name )
+end
 
-    return pkgpath, extdir
+function rpc_search_async ( query, callback, pkgcb )
+    return spawn( callback, rpc_search, query, pkgcb )
+end
+
+function pkgbuild_text_async ( pkgname, callback )
+    return spawn( callback, pkgbuild_text, pkgname )
+end
+
+function download_async ( pkgname, destdir, callback )
+    return spawn( callback, download, pkgname, destdir )
+end
+
+function download_extract_async ( pkgname, destdir, callback )
+    return spawn( callback, download_extract, pkgname, destdir )
 end
 
 function customizepkg ( pkgname, pkgdir )
@@ -382,99 +1591,81 @@ function customizepkg ( pkgname, pkgdir )
     end
 end
 
-function makepkg ( target )
-    -- config.mkpkgopts don't seem to get set anywhere
-    -- for now it is safe to assume they are empty...
-    local cmdlineopts = table.concat( config.mkpkgopts, " " )
-
-    local oldwd = lfs.currentdir()
-    assert( lfs.chdir( target ))
+local root_build_ok = false
+
+-- Warns about building as root, once per run, and errors out unless
+-- the user wants to go on anyway.
+local function confirm_root_build ()
+    if root_build_ok then return end
+
+    -- Try to warn people away from running makepkg as root...
+    printf( C.redb("==> ")
+    .. C.bright( C.onred( "Running makepkg as root is a bad idea!" )))
+    print("")
+    printf( C.redb("==> ")
+        .. C.bright("To avoid this message please set BuildUser "
+                    .. "in clyde.conf\n"))
+    local response = noyes( C.redb("==> ")
+                        .. C.bright("Continue anyway?"))
+    if not response then error( "Build aborted" ) end
+    root_build_ok = true
+end
 
-    local user = get_builduser().name
-    local maker
+-- Returns the argv which runs makepkg with the options in args,
+-- followed by the user's makepkg options. The build user runs it
+-- through buildhelper; only when that is root does it get --asroot.
+function makepkg_argv ( args )
+    local argv = { "makepkg" }
 
     -- We assume we are being run as root but whether the "build user"
     -- is root or not is important...
-    if (user == "root") then
-        maker = function ()
-            -- Try to warn people away from running makepkg as root...
-            printf( C.redb("==> ")
-            .. C.bright( C.onred( "Running makepkg as root is a bad idea!" )))
-            print("")
-            printf( C.redb("==> ")
-                .. C.bright("To avoid this message please set BuildUser "
-                            .. "in clyde.conf\n"))
-            local response = noyes( C.redb("==> ")
-                                .. C.bright("Continue anyway?"))
-            if ( response )  then
-                return os.execute("makepkg -f --asroot "..cmdlineopts)
-            else
-                error( "Build aborted" )
-            end
-        end
-    else
-        -- Since we are already root we can use su to switch users...
-        maker = function ()
-            local cmdline = string.format( "su %s -c 'makepkg -f %s'",
-                                           user, cmdlineopts )
-            return os.execute( cmdline )
-        end
+    if utilcore.geteuid() == 0 and get_builduser().uid == 0 then
+        confirm_root_build()
+        table.insert( argv, "--asroot" )
     end
 
-    local oldmask = umask( "022" )
-    local retcode = maker()
-
-    lfs.chdir( oldwd ) -- always chdir back
-    umask( oldmask )   -- and restore umask
-
-    -- util.cleanup exits clyde...
-    if retcode ~= 0 then util.cleanup( retcode ) end
-    return
+    -- config.mkpkgopts don't seem to get set anywhere
+    -- for now it is safe to assume they are empty...
+    for i, opt in ipairs( util.tbljoin( args, config.mkpkgopts )) do
+        table.insert( argv, opt )
+    end
+    return argv
 end
 
-function installpkg( target )
-    local user     = get_builduser().name
-    local builddir = get_builddir()
-
+-- Returns the directory where makepkg puts the packages it builds for
+-- target.
+function pkgdest ( target )
+    local user   = get_builduser().name
     local pkgdir = os.getenv( "PKGDEST" )
         or util.getbasharrayuser( "/etc/makepkg.conf", "PKGDEST", user )
 
     if not pkgdir or #pkgdir == 0 then
-        pkgdir = builddir.."/"..target.."/"..target
-    end
-
-    extmatch = util.getbasharray( "/etc/makepkg.conf", "PKGEXT" )
-    extmatch = extmatch:gsub( "%.", "%%." )
-    local pkgfiles = {}
-    for file in lfs.dir( pkgdir ) do
-        if ( file:sub( 1, #target ) == target
-             and file:match( extmatch .. "$" )) then
-            table.insert( pkgfiles, pkgdir .. "/" .. file )
-        end
+        pkgdir = get_builddir().."/"..target.."/"..target
     end
+    return pkgdir
+end
 
-    local maxn = #pkgfiles
-    if maxn == 0 then
+-- Returns the path of the newest package built for target.
+function pkgfile( target )
+    local pkgdir = pkgdest( target )
+    local path = pkgdestindex.newest( pkgdir, target )
+    if not path then
         eprintf( "LOG_ERROR", "Could not find a built package in %s.",
                  pkgdir )
         util.cleanup( 1 )
     end
+    return path
+end
 
-    local function pkg_ver ( pkgpath )
-        local pkg, retcode = alpm.pkg_load( pkgpath, false )
-        if not retcode or retcode ~= 0 then
-            error( "Failed to load package file:\n" .. pkgpath .. "\n"
-                   .. "ALPM Error: " .. alpm.strerrorlast())
-        end
-        return pkg:pkg_get_version()
-    end
-
-    local function by_version ( left, right )
-        return alpm.pkg_vercmp( pkg_ver( left ), pkg_ver( right )) < 0
+--[[ Installs the newest packages built for targets, all in the same
+     transaction, and returns their paths in the order of targets. ]]--
+function installpkgs( targets )
+    local pkgfiles = {}
+    for i, target in ipairs( targets ) do
+        table.insert( pkgfiles, pkgfile( target ))
     end
 
-    table.sort( pkgfiles, by_version ) -- highest version should be last now
-    local ret = upgrade.main({ pkgfiles[ maxn ] }) -- expects a table as arg
+    local ret = upgrade.main( pkgfiles )
     if ( ret ~= 0 ) then util.cleanup( ret ) end
-    return
+    return pkgfiles
 end
@@ -0,0 +1,424 @@
+module(..., package.seeall)
+---searching AUR package names without asking the AUR---
+local lfs     = require "lfs"
+local zlib    = require "zlib"
+local yajl    = require "yajl"
+local ltn12   = require "ltn12"
+
+local util    = require "clydelib.util"
+local lprintf = util.lprintf
+local printf  = util.printf
+local cache   = require "clydelib.cache"
+local aur     = require "clydelib.aur"
+
+--[[ The AUR publishes the metadata of every package in one gzipped JSON
+     file. When AurIndex is set in clyde.conf we fetch it along with the
+     sync databases (-Sy) and turn it into an index in the "aurindex"
+     cache subdirectory. -Ss and shell completion can then search it
+     without going to the network.
+
+     The index is made of four files:
+
+     records  - one line per package: name, version, votes, out of date
+                flag, last modified time and description, split by tabs.
+     offsets  - the offset of each line in records, as fixed width hex.
+     trigrams - fixed width lines of a trigram (as hex) and the offset
+                of its postings, sorted so they can be binary searched.
+     postings - for each trigram, the numbers of the records containing
+                it, as hex deltas split by commas.
+
+     Trigrams are taken from the lowercased name and description. Names
+     are indexed as NAME_START .. name .. NAME_END so that a search
+     anchored with ^ or $ is only another trigram. ]]--
+
+local META_PATH    = "/packages-meta-v1.json.gz"
+local SUBDIR       = "aurindex"
+local NAME_START   = "\1"
+local NAME_END     = "\2"
+local OFFSET_WIDTH = 9  -- "%08x\n"
+local TRI_WIDTH    = 16 -- "%06x %08x\n"
+
+local FILES = { "records", "offsets", "trigrams", "postings" }
+
+local function index_path ( name )
+    return cache.subdir_path( SUBDIR ) .. "/" .. name
+end
+
+-- Returns true if there is an index to search.
+function available ()
+    if not config.aur_index then return false end
+    for i, name in ipairs( FILES ) do
+        if not lfs.attributes( index_path( name ), "mode" ) then
+            return false
+        end
+    end
+    return true
+end
+
+-- Building ------------------------------------------------------------------
+
+-- Tabs and newlines split the fields and lines of the records file.
+local function clean ( str )
+    return ( tostring( str or "" ):gsub( "[\t\r\n]", " " ))
+end
+
+local function trigram_code ( str, i )
+    local a, b, c = str:byte( i, i + 2 )
+    return a * 65536 + b * 256 + c
+end
+
+-- Adds the trigrams of str to seen, a set of trigram codes.
+local function add_trigrams ( seen, str )
+    for i = 1, #str - 2 do seen[ trigram_code( str, i ) ] = true end
+end
+
+-- Returns a yajl parser which calls pkgcb with each package in the
+-- packages-meta-v1 JSON array.
+local function meta_parser ( pkgcb )
+    local depth, key, pkg = 0, nil, nil
+    local WANTED = { Name = "name", Version = "version",
+                     Description = "desc", NumVotes = "votes",
+                     OutOfDate = "outdated", LastModified = "lastmod" }
+    return yajl.parser {
+        events = { open_array  = function () depth = depth + 1 end,
+                   open_object = function ()
+                                     depth = depth + 1
+                                     if depth == 2 then pkg = {} end
+                                 end,
+                   close       = function ( evts, type )
+                                     if depth == 2 and type == "object" then
+                                         pkgcb( pkg )
+                                         pkg = nil
+                                     end
+                                     depth = depth - 1
+                                 end,
+                   object_key  = function ( evts, name )
+                                     key = WANTED[ name ]
+                                 end,
+                   value       = function ( evts, value )
+                                     if pkg and depth == 2 and key then
+                                         pkg[ key ] = value
+                                     end
+                                 end } }
+end
+
+-- Writes the index files for pkgs (a list of package infos) to the
+-- temporary files named in tmp.
+local function write_index ( pkgs, tmp )
+    table.sort( pkgs, function ( a, b ) return a.name < b.name end )
+
+    local records = assert( io.open( tmp.records, "w" ))
+    local offsets = assert( io.open( tmp.offsets, "w" ))
+    local postings_of = {}
+    local offset = 0
+
+    for recno, pkg in ipairs( pkgs ) do
+        local line = table.concat( { clean( pkg.name ),
+                                     clean( pkg.version ),
+                                     clean( pkg.votes or 0 ),
+                                     pkg.outdated and "1" or "0",
+                                     clean( pkg.lastmod or 0 ),
+                                     clean( pkg.desc ) }, "\t" ) .. "\n"
+        records:write( line )
+        offsets:write( string.format( "%08x\n", offset ))
+        offset = offset + #line
+
+        local seen = {}
+        add_trigrams( seen, NAME_START .. clean( pkg.name ):lower()
+                            .. NAME_END )
+        add_trigrams( seen, clean( pkg.desc ):lower() )
+        for code in pairs( seen ) do
+            local list = postings_of[ code ]
+            if not list then list = {}; postings_of[ code ] = list end
+            table.insert( list, recno - 1 )
+        end
+    end
+    records:close()
+    offsets:close()
+
+    local codes = {}
+    for code in pairs( postings_of ) do table.insert( codes, code ) end
+    table.sort( codes )
+
+    local trigrams = assert( io.open( tmp.trigrams, "w" ))
+    local postings = assert( io.open( tmp.postings, "w" ))
+    offset = 0
+    for i, code in ipairs( codes ) do
+        -- Record numbers were added in order, store the gaps between them.
+        local list, prev, deltas = postings_of[ code ], 0, {}
+        for j, recno in ipairs( list ) do
+            deltas[j] = string.format( "%x", recno - prev )
+            prev = recno
+        end
+        local line = table.concat( deltas, "," ) .. "\n"
+
+        trigrams:write( string.format( "%06x %08x\n", code, offset ))
+        postings:write( line )
+        offset = offset + #line
+    end
+    trigrams:close()
+    postings:close()
+end
+
+--[[ Fetches the AUR package list and rebuilds the index from it. Unless
+     force is true (-Syy) the list is only downloaded if it changed since
+     the last time. Returns true if the index is up to date. ]]--
+function refresh ( force )
+    if not config.aur_index then return true end
+    if not cache.writable( SUBDIR ) then
+        lprintf( "LOG_WARNING", "cannot write the AUR index to %s\n",
+                 cache.subdir_path( SUBDIR ))
+        return false
+    end
+
+    local meta    = cache.load( SUBDIR, "meta" )
+    local headers = {}
+    if meta and meta.lastmod and not force and available() then
+        headers[ "If-Modified-Since" ] = meta.lastmod
+    end
+
+    local chunks = {}
+    local ret, code, resheaders = aur.http_request {
+        url     = aur.aururi( META_PATH ),
+        headers = headers,
+        sink    = ltn12.sink.table( chunks ) }
+    if not ret then
+        lprintf( "LOG_ERROR", "failed to update the AUR index (%s)\n",
+                 tostring( code ))
+        return false
+    end
+    if code == 304 then
+        printf( " aur is up to date\n" )
+        return true
+    end
+    if code ~= 200 then
+        lprintf( "LOG_ERROR", "failed to update the AUR index (HTTP %d)\n",
+                 code )
+        return false
+    end
+
+    -- The file is a .gz, not a gzip content-encoding, so the HTTP code
+    -- has left it alone.
+    local json = table.concat( chunks )
+    chunks = nil
+    if json:sub( 1, 2 ) == "\31\139" then
+        json = zlib.inflate( json ):read( "*a" )
+    end
+
+    local pkgs = {}
+    local parser = meta_parser( function ( pkg )
+                                    if pkg.name then
+                                        table.insert( pkgs, pkg )
+                                    end
+                                end )
+    local ok, err = pcall( function () parser( json ); parser( nil ) end )
+    json = nil
+    if not ok then
+        lprintf( "LOG_ERROR", "failed to parse the AUR index (%s)\n",
+                 tostring( err ))
+        return false
+    end
+
+    local tmp = {}
+    for i, name in ipairs( FILES ) do tmp[ name ] = index_path( name ) .. ".tmp" end
+    write_index( pkgs, tmp )
+    for i, name in ipairs( FILES ) do
+        assert( os.rename( tmp[ name ], index_path( name )))
+    end
+
+    cache.store( SUBDIR, "meta", { lastmod = resheaders[ "last-modified" ],
+                                   count   = #pkgs,
+                                   time    = os.time() } )
+    lprintf( "LOG_DEBUG", "AUR index has %d packages\n", #pkgs )
+    return true
+end
+
+-- Searching -----------------------------------------------------------------
+
+local index -- open file handles, while searching
+
+local function open_index ()
+    if index then return index end
+    index = {}
+    for i, name in ipairs( FILES ) do
+        index[ name ] = assert( io.open( index_path( name ), "rb" ))
+    end
+    index.nrecords = index.offsets:seek( "end" ) / OFFSET_WIDTH
+    index.ntrigrams = index.trigrams:seek( "end" ) / TRI_WIDTH
+    return index
+end
+
+local function close_index ()
+    if not index then return end
+    for i, name in ipairs( FILES ) do index[ name ]:close() end
+    index = nil
+end
+
+-- Turns a line of the records file into an info table.
+local function parse_record ( line )
+    local name, version, votes, outdated, lastmod, desc =
+        line:match( "^([^\t]*)\t([^\t]*)\t([^\t]*)\t([^\t]*)\t([^\t]*)\t(.*)$" )
+    return { name = name, version = version, votes = votes,
+             outdated = ( outdated == "1" ), lastmod = tonumber( lastmod ),
+             desc = desc }
+end
+
+-- Returns the info table of record number recno.
+local function read_record ( recno )
+    index.offsets:seek( "set", recno * OFFSET_WIDTH )
+    local offset = tonumber( index.offsets:read( 8 ), 16 )
+    index.records:seek( "set", offset )
+    return parse_record( index.records:read( "*l" ))
+end
+
+-- Returns the sorted list of record numbers containing a trigram.
+local function postings ( code )
+    local lo, hi = 0, index.ntrigrams - 1
+    while lo <= hi do
+        local mid = math.floor(( lo + hi ) / 2 )
+        index.trigrams:seek( "set", mid * TRI_WIDTH )
+        local entry = index.trigrams:read( TRI_WIDTH )
+        local found = tonumber( entry:sub( 1, 6 ), 16 )
+        if found == code then
+            index.postings:seek( "set", tonumber( entry:sub( 8, 15 ), 16 ))
+            local list, recno = {}, 0
+            for delta in index.postings:read( "*l" ):gmatch( "%x+" ) do
+                recno = recno + tonumber( delta, 16 )
+                table.insert( list, recno )
+            end
+            return list
+        elseif found < code then lo = mid + 1
+        else hi = mid - 1 end
+    end
+    return {}
+end
+
+--[[ Parses a query like rpc_search does, allowing only ^ and $ anchors.
+     Returns a table with the lowercased text, the anchors, and the
+     string whose trigrams any match must contain. ]]--
+local function parse_query ( query )
+    local q = { text = query:lower() }
+    if q.text:match( "^^" ) then q.start = true; q.text = q.text:sub( 2 ) end
+    if q.text:match( "%$$" ) then q.stop = true; q.text = q.text:sub( 1, -2 ) end
+    q.key = ( q.start and NAME_START or "" ) .. q.text
+        .. ( q.stop and NAME_END or "" )
+    return q
+end
+
+-- Does the package in info match the parsed query q?
+local function matches ( q, info )
+    local name = info.name:lower()
+    if q.start or q.stop then
+        local key = NAME_START .. name .. NAME_END
+        return key:find( q.key, 1, true ) ~= nil
+    end
+    return name:find( q.text, 1, true ) ~= nil
+        or ( info.desc or "" ):lower():find( q.text, 1, true ) ~= nil
+end
+
+-- Returns the sorted list of record numbers which may match q, or nil
+-- if q is too short to have any trigrams and every record may match.
+local function candidates ( q )
+    if #q.key < 3 then return nil end
+
+    local lists = {}
+    for i = 1, #q.key - 2 do
+        table.insert( lists, postings( trigram_code( q.key, i )))
+    end
+    table.sort( lists, function ( a, b ) return #a < #b end )
+
+    local result = lists[1]
+    for i = 2, #lists do
+        if #result == 0 then break end
+        local set = {}
+        for j, recno in ipairs( lists[i] ) do set[ recno ] = true end
+        local kept = {}
+        for j, recno in ipairs( result ) do
+            if set[ recno ] then table.insert( kept, recno ) end
+        end
+        result = kept
+    end
+    return result
+end
+
+--[[ Searches the index for packages matching all of the queries, like
+     rpc_search would for each one, and returns a table mapping names
+     to their info. ]]--
+function search ( queries )
+    local qs = {}
+    for i, query in ipairs( queries ) do qs[i] = parse_query( query ) end
+
+    open_index()
+    local ok, results = pcall( function ()
+        -- Only read the records which have every query's trigrams.
+        local recnos
+        for i, q in ipairs( qs ) do
+            local cands = candidates( q )
+            if cands and recnos then
+                local set = {}
+                for j, recno in ipairs( cands ) do set[ recno ] = true end
+                local kept = {}
+                for j, recno in ipairs( recnos ) do
+                    if set[ recno ] then table.insert( kept, recno ) end
+                end
+                recnos = kept
+            elseif cands then
+                recnos = cands
+            end
+        end
+        if not recnos then
+            recnos = {}
+            for recno = 0, index.nrecords - 1 do recnos[ recno + 1 ] = recno end
+        end
+
+        local results = {}
+        for i, recno in ipairs( recnos ) do
+            local info = read_record( recno )
+            local all = true
+            for j, q in ipairs( qs ) do
+                if not matches( q, info ) then all = false; break end
+            end
+            if all then results[ info.name ] = info end
+        end
+        return results
+    end )
+    close_index()
+
+    if not ok then error( results, 0 ) end
+    return results
+end
+
+-- Returns the info of the package named name, or nil.
+function lookup ( name )
+    local results = search{ "^" .. name .. "$" }
+    return results[ name ]
+end
+
+-- Returns a table mapping those of names which are in the index to their
+-- info. Reads through the records once instead of searching each name.
+function lookup_names ( names )
+    local wanted, results = {}, {}
+    for i, name in ipairs( names ) do wanted[ name ] = true end
+    if not next( wanted ) then return results end
+
+    local fh = assert( io.open( index_path( "records" ), "rb" ))
+    for line in fh:lines() do
+        if wanted[ line:match( "^[^\t]*" ) ] then
+            local info = parse_record( line )
+            results[ info.name ] = info
+        end
+    end
+    fh:close()
+
+    return results
+end
+
+-- Returns the sorted names of packages starting with prefix.
+function complete ( prefix )
+    local names = {}
+    for name in pairs( search{ "^" .. prefix } ) do
+        if name:sub( 1, #prefix ) == prefix then table.insert( names, name ) end
+    end
+    table.sort( names )
+    return names
+end
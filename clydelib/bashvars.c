@@ -0,0 +1,857 @@
+/* gcc -W -Wall -pedantic -std=c99 -D_GNU_SOURCE `pkg-config --cflags lua` -fPIC -shared -o bashvars.so bashvars.c */
+
+/* Reads the variables set by a PKGBUILD or makepkg.conf without running
+   bash. Almost all of them only assign strings and arrays, maybe
+   depending on $CARCH, and define functions we do not care about. This
+   understands that much:
+
+     - assignments, appends (+=) and arrays, over as many lines as needed
+     - single and double quotes, backslashes and line continuations
+     - $name, ${name}, and ${name[@]} or ${name[*]} as a whole word
+     - [ ], [[ ]] tests with =, ==, != , -n and -z, followed by && or ||
+     - if/elif/else/fi on such tests, and case with plain patterns
+     - function definitions, which are skipped
+
+   Anything else (command substitution, parameter operators, globs,
+   other commands...) makes parse() give up and say why, so that the
+   caller can let bash do it instead. So do statements nested deeper
+   than MAX_DEPTH, which keeps the recursion, and what it leaves on the
+   Lua stack, bounded for any text.
+
+   extras/bashvarscheck compares what parse() makes of a set of cases
+   with what bash does. */
+
+#include <lua.h>
+#include <lualib.h>
+#include <lauxlib.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+enum { WORD_NONE, WORD_TEXT, WORD_SPLICE };
+
+#define MAX_DEPTH 16
+
+typedef struct {
+    lua_State  *L;
+    const char *start, *pos, *end;
+    int         vars;   /* stack index of the variables table */
+    char       *buf;    /* the word being read */
+    size_t      len, size;
+    int         splice; /* stack index of the array a word expanded to */
+    int         depth;  /* of the statement being parsed */
+} parser;
+
+static void fail ( parser *p, const char *why )
+{
+    const char *c;
+    int line = 1;
+
+    for ( c = p->start ; c < p->pos && c < p->end ; ++c ) {
+        if ( *c == '\n' ) ++line;
+    }
+    luaL_error( p->L, "line %d: %s", line, why );
+}
+
+static int peek ( parser *p, size_t off )
+{
+    if ( p->pos + off >= p->end ) return EOF;
+    return (unsigned char) p->pos[ off ];
+}
+
+static void buf_add ( parser *p, const char *s, size_t n )
+{
+    if ( p->splice ) fail( p, "array expansion inside of a word" );
+
+    if ( p->len + n > p->size ) {
+        size_t size = p->size ? p->size : 64;
+        char *buf;
+
+        while ( size < p->len + n ) size *= 2;
+        buf = realloc( p->buf, size );
+        if ( buf == NULL ) luaL_error( p->L, "out of memory" );
+        p->buf  = buf;
+        p->size = size;
+    }
+    memcpy( p->buf + p->len, s, n );
+    p->len += n;
+}
+
+static void buf_addchar ( parser *p, char c )
+{
+    buf_add( p, &c, 1 );
+}
+
+static int is_blank ( int c )
+{
+    return c == ' ' || c == '\t';
+}
+
+static int is_word_end ( int c )
+{
+    return c == EOF || strchr( " \t\n;&|()<>", c ) != NULL;
+}
+
+static int is_name_start ( int c )
+{
+    return c != EOF && ( isalpha( c ) || c == '_' );
+}
+
+static int is_name_char ( int c )
+{
+    return c != EOF && ( isalnum( c ) || c == '_' );
+}
+
+/* Returns the length of the name at the current position, or 0. */
+static size_t name_len ( parser *p )
+{
+    size_t n = 0;
+
+    if ( ! is_name_start( peek( p, 0 ))) return 0;
+    while ( is_name_char( peek( p, n ))) ++n;
+    return n;
+}
+
+/* True if keyword is the word at the current position. */
+static int at_keyword ( parser *p, const char *keyword )
+{
+    size_t n = strlen( keyword );
+
+    return (size_t) ( p->end - p->pos ) >= n
+        && strncmp( p->pos, keyword, n ) == 0
+        && is_word_end( peek( p, n ));
+}
+
+static void skip_blanks ( parser *p )
+{
+    for (;;) {
+        if ( is_blank( peek( p, 0 ))) {
+            ++p->pos;
+        }
+        else if ( peek( p, 0 ) == '\\' && peek( p, 1 ) == '\n' ) {
+            p->pos += 2;
+        }
+        else break;
+    }
+}
+
+static void skip_comment ( parser *p )
+{
+    if ( peek( p, 0 ) != '#' ) return;
+    while ( peek( p, 0 ) != EOF && peek( p, 0 ) != '\n' ) ++p->pos;
+}
+
+/* Skips blanks, newlines and comments. */
+static void skip_space ( parser *p )
+{
+    for (;;) {
+        skip_blanks( p );
+        skip_comment( p );
+        if ( peek( p, 0 ) != '\n' ) break;
+        ++p->pos;
+    }
+}
+
+/* Pushes the array table of a variable, or nil if it is not set. */
+static void push_var ( parser *p, const char *name, size_t len )
+{
+    const char *value;
+
+    /* One for the table, one for what goes in it and one for the caller. */
+    luaL_checkstack( p->L, 3, "too many nested expansions" );
+    lua_pushlstring( p->L, name, len );
+    lua_rawget( p->L, p->vars );
+    if ( ! lua_isnil( p->L, -1 )) return;
+    lua_pop( p->L, 1 );
+
+    /* bash would see the environment, too. */
+    lua_pushlstring( p->L, name, len );
+    value = getenv( lua_tostring( p->L, -1 ));
+    lua_pop( p->L, 1 );
+    if ( value == NULL ) {
+        lua_pushnil( p->L );
+        return;
+    }
+    lua_createtable( p->L, 1, 0 );
+    lua_pushstring( p->L, value );
+    lua_rawseti( p->L, -2, 1 );
+}
+
+/* Reads a $ expansion into the word. Unquoted values which bash would
+   split into several words are refused. */
+static void expand ( parser *p, int quoted, int split )
+{
+    const char *name;
+    size_t len, i, n;
+    int all = 0, joined = 0;
+
+    ++p->pos; /* the $ */
+    if ( peek( p, 0 ) == '{' ) {
+        ++p->pos;
+        len  = name_len( p );
+        name = p->pos;
+        if ( len == 0 ) fail( p, "unsupported ${...} expansion" );
+        p->pos += len;
+
+        if ( peek( p, 0 ) == '[' && ( peek( p, 1 ) == '@' || peek( p, 1 ) == '*' )
+             && peek( p, 2 ) == ']' ) {
+            all    = 1;
+            joined = ( peek( p, 1 ) == '*' );
+            p->pos += 3;
+        }
+        if ( peek( p, 0 ) != '}' ) fail( p, "unsupported ${...} expansion" );
+        ++p->pos;
+    }
+    else if ( ( len = name_len( p )) > 0 ) {
+        name = p->pos;
+        p->pos += len;
+    }
+    else if ( peek( p, 0 ) == EOF || strchr( "(\'@*#?$!-0123456789", peek( p, 0 ))) {
+        fail( p, "unsupported $ expansion" );
+        return;
+    }
+    else {
+        buf_addchar( p, '$' );
+        return;
+    }
+
+    push_var( p, name, len );
+    if ( lua_isnil( p->L, -1 )) {
+        lua_pop( p->L, 1 );
+        lua_newtable( p->L );
+    }
+
+    n = lua_objlen( p->L, -1 );
+    if ( all && split && ! quoted && n > 1 ) {
+        fail( p, "unquoted expansion would be split" );
+    }
+    if ( all && ! joined ) {
+        /* "${name[@]}" becomes one word for each element. */
+        if ( p->len > 0 || p->splice ) {
+            fail( p, "array expansion inside of a word" );
+        }
+        p->splice = lua_gettop( p->L );
+        return;
+    }
+
+    for ( i = 1 ; i <= ( all ? n : ( n > 0 ? 1 : 0 )) ; ++i ) {
+        const char *value;
+        size_t vlen;
+
+        if ( i > 1 ) buf_addchar( p, ' ' );
+        lua_rawgeti( p->L, -1, i );
+        value = lua_tolstring( p->L, -1, &vlen );
+        if ( value == NULL ) value = "", vlen = 0;
+        if ( split && ! quoted && strpbrk( value, " \t\n" )) {
+            fail( p, "unquoted expansion would be split" );
+        }
+        buf_add( p, value, vlen );
+        lua_pop( p->L, 1 );
+    }
+    lua_pop( p->L, 1 );
+}
+
+static void read_dquoted ( parser *p )
+{
+    int c;
+
+    ++p->pos; /* the opening quote */
+    for (;;) {
+        c = peek( p, 0 );
+        if ( c == EOF ) fail( p, "unterminated double quote" );
+        if ( c == '"' ) {
+            ++p->pos;
+            return;
+        }
+        if ( c == '`' ) fail( p, "command substitution" );
+        if ( c == '$' ) {
+            expand( p, 1, 0 );
+            continue;
+        }
+        if ( c == '\\' && peek( p, 1 ) != EOF && strchr( "$`\"\\\n", peek( p, 1 ))) {
+            if ( peek( p, 1 ) != '\n' ) buf_addchar( p, peek( p, 1 ));
+            p->pos += 2;
+            continue;
+        }
+        buf_addchar( p, c );
+        ++p->pos;
+    }
+}
+
+/* Reads a word into p->buf. In split contexts (array elements, test
+   operands) bash would also split and glob it, so words which would
+   be changed by that are refused. Returns WORD_NONE if the word was
+   empty after all, WORD_SPLICE if it expanded to the array at stack
+   index p->splice (see drop_splice), or WORD_TEXT. */
+static int read_word ( parser *p, int split )
+{
+    int present = 0, c;
+
+    p->len = 0;
+    for (;;) {
+        c = peek( p, 0 );
+        if ( is_word_end( c )) break;
+        if ( c != '$' ) present = 1;
+
+        if ( c == '\'' ) {
+            const char *close = memchr( p->pos + 1, '\'', p->end - p->pos - 1 );
+            if ( close == NULL ) fail( p, "unterminated single quote" );
+            buf_add( p, p->pos + 1, close - p->pos - 1 );
+            p->pos = close + 1;
+        }
+        else if ( c == '"' ) {
+            read_dquoted( p );
+        }
+        else if ( c == '\\' ) {
+            if ( peek( p, 1 ) == EOF ) fail( p, "backslash at the end" );
+            if ( peek( p, 1 ) != '\n' ) buf_addchar( p, peek( p, 1 ));
+            p->pos += 2;
+        }
+        else if ( c == '$' ) {
+            if ( peek( p, 1 ) == '\'' ) fail( p, "unsupported $'...' quoting" );
+            expand( p, 0, split );
+        }
+        else if ( c == '`' ) {
+            fail( p, "command substitution" );
+        }
+        else {
+            if ( split && strchr( "*?[{", c )) {
+                fail( p, "glob or brace expansion" );
+            }
+            if ( split && c == '~' && p->len == 0 ) {
+                fail( p, "tilde expansion" );
+            }
+            buf_addchar( p, c );
+            ++p->pos;
+        }
+    }
+
+    if ( p->splice ) return WORD_SPLICE;
+    return present || p->len > 0 ? WORD_TEXT : WORD_NONE;
+}
+
+/* Takes the array a WORD_SPLICE expanded to off of the stack. */
+static void drop_splice ( parser *p )
+{
+    lua_remove( p->L, p->splice );
+    p->splice = 0;
+}
+
+/* Appends the word just read to the array table at stack index arr. */
+static void append_word ( parser *p, int type, int arr )
+{
+    lua_State *L = p->L;
+    size_t i, n = lua_objlen( L, arr );
+
+    if ( type == WORD_TEXT ) {
+        lua_pushlstring( L, p->buf, p->len );
+        lua_rawseti( L, arr, n + 1 );
+    }
+    else if ( type == WORD_SPLICE ) {
+        size_t count = lua_objlen( L, p->splice );
+        for ( i = 1 ; i <= count ; ++i ) {
+            lua_rawgeti( L, p->splice, i );
+            lua_rawseti( L, arr, n + i );
+        }
+        drop_splice( p );
+    }
+}
+
+/* The end of a simple statement: a newline, a ; which is not a ;;, a
+   comment or the end of the text. */
+static void end_statement ( parser *p )
+{
+    skip_blanks( p );
+    skip_comment( p );
+    if ( peek( p, 0 ) == ';' && peek( p, 1 ) != ';' ) ++p->pos;
+    else if ( peek( p, 0 ) == '\n' ) ++p->pos;
+    else if ( peek( p, 0 ) != EOF && peek( p, 0 ) != ';' ) {
+        fail( p, "unsupported command" );
+    }
+}
+
+static void parse_assignment ( parser *p, int run, size_t namelen )
+{
+    lua_State *L = p->L;
+    const char *name = p->pos;
+    int append, type, arr;
+
+    luaL_checkstack( L, 4, "too many nested statements" );
+    p->pos += namelen;
+    append = ( peek( p, 0 ) == '+' );
+    p->pos += append ? 2 : 1;
+
+    if ( peek( p, 0 ) == '(' ) {
+        ++p->pos;
+        if ( append ) {
+            push_var( p, name, namelen );
+            if ( lua_isnil( L, -1 )) {
+                lua_pop( L, 1 );
+                lua_newtable( L );
+            }
+            else {
+                /* Copy it, the table may be shared. */
+                size_t i, n = lua_objlen( L, -1 );
+                lua_createtable( L, n, 0 );
+                for ( i = 1 ; i <= n ; ++i ) {
+                    lua_rawgeti( L, -2, i );
+                    lua_rawseti( L, -2, i );
+                }
+                lua_remove( L, -2 );
+            }
+        }
+        else lua_newtable( L );
+        arr = lua_gettop( L );
+
+        for (;;) {
+            const char *before;
+
+            skip_space( p );
+            if ( peek( p, 0 ) == ')' ) {
+                ++p->pos;
+                break;
+            }
+            if ( peek( p, 0 ) == EOF ) fail( p, "unterminated array" );
+
+            before = p->pos;
+            type   = read_word( p, 1 );
+            if ( p->pos == before ) fail( p, "unexpected character in array" );
+            append_word( p, type, arr );
+        }
+    }
+    else {
+        type = read_word( p, 0 );
+        if ( type == WORD_SPLICE ) {
+            /* A scalar gets the elements joined by spaces. */
+            size_t i, n = lua_objlen( L, p->splice );
+            int splice = p->splice;
+
+            p->splice = 0; /* or buf_add() would refuse */
+            for ( i = 1 ; i <= n ; ++i ) {
+                if ( i > 1 ) buf_addchar( p, ' ' );
+                lua_rawgeti( L, splice, i );
+                buf_add( p, lua_tostring( L, -1 ), lua_objlen( L, -1 ));
+                lua_pop( L, 1 );
+            }
+            lua_remove( L, splice );
+        }
+
+        lua_createtable( L, 1, 0 );
+        if ( append ) {
+            push_var( p, name, namelen );
+            if ( ! lua_isnil( L, -1 )) lua_rawgeti( L, -1, 1 );
+            else lua_pushliteral( L, "" );
+            lua_remove( L, -2 );
+            if ( ! lua_isstring( L, -1 )) {
+                lua_pop( L, 1 );
+                lua_pushliteral( L, "" );
+            }
+            lua_pushlstring( L, p->buf, p->len );
+            lua_concat( L, 2 );
+        }
+        else lua_pushlstring( L, p->buf, p->len );
+        lua_rawseti( L, -2, 1 );
+    }
+
+    if ( run ) {
+        lua_pushlstring( L, name, namelen );
+        lua_insert( L, -2 );
+        lua_rawset( L, p->vars );
+    }
+    else lua_pop( L, 1 );
+}
+
+/* Skips the body of a function, from its opening brace. */
+static void skip_body ( parser *p )
+{
+    int depth = 0, c, prev = '\n';
+
+    do {
+        c = peek( p, 0 );
+        if ( c == EOF ) fail( p, "unterminated function" );
+
+        if ( c == '\\' ) {
+            ++p->pos;
+        }
+        else if ( c == '\'' && prev == '$' ) {
+            /* $'...' may contain backslashed quotes. */
+            for ( ++p->pos ; peek( p, 0 ) != '\'' ; ++p->pos ) {
+                if ( peek( p, 0 ) == EOF ) fail( p, "unterminated quote" );
+                if ( peek( p, 0 ) == '\\' ) ++p->pos;
+            }
+        }
+        else if ( c == '\'' ) {
+            const char *close = memchr( p->pos + 1, '\'', p->end - p->pos - 1 );
+            if ( close == NULL ) fail( p, "unterminated single quote" );
+            p->pos = close;
+        }
+        else if ( c == '"' ) {
+            for ( ++p->pos ; peek( p, 0 ) != '"' ; ++p->pos ) {
+                if ( peek( p, 0 ) == EOF ) fail( p, "unterminated double quote" );
+                if ( peek( p, 0 ) == '\\' ) ++p->pos;
+            }
+        }
+        else if ( c == '#' && strchr( " \t\n;&|(", prev )) {
+            skip_comment( p );
+            prev = '\n';
+            continue;
+        }
+        else if ( c == '<' && peek( p, 1 ) == '<' ) {
+            if ( peek( p, 2 ) != '<' ) fail( p, "here document" );
+            p->pos += 2; /* a here string is fine */
+        }
+        else if ( c == '{' ) ++depth;
+        else if ( c == '}' ) --depth;
+
+        prev = c;
+        ++p->pos;
+    } while ( depth > 0 );
+}
+
+/* After a function's name: skips "()" and the body. */
+static void skip_function ( parser *p )
+{
+    skip_blanks( p );
+    if ( peek( p, 0 ) == '(' ) {
+        ++p->pos;
+        skip_blanks( p );
+        if ( peek( p, 0 ) != ')' ) fail( p, "unsupported command" );
+        ++p->pos;
+    }
+    skip_space( p );
+    if ( peek( p, 0 ) != '{' ) fail( p, "unsupported function body" );
+    skip_body( p );
+}
+
+/* Skips a function definition, from its name. Names may have more in
+   them than variable names, like package_foo-git. */
+static void parse_function ( parser *p )
+{
+    const char *name = p->pos;
+
+    while ( ! is_word_end( peek( p, 0 )) && ! strchr( "'\"\\$`=", peek( p, 0 ))) {
+        ++p->pos;
+    }
+    if ( p->pos == name ) fail( p, "unsupported command" );
+
+    skip_blanks( p );
+    if ( peek( p, 0 ) != '(' && peek( p, 0 ) != '{' && peek( p, 0 ) != '\n' ) {
+        p->pos = name;
+        fail( p, "unsupported command" );
+    }
+    skip_function( p );
+    end_statement( p );
+}
+
+/* Reads a [ ] or [[ ]] test and returns whether it is true. An empty
+   unquoted expansion is no operand at all in [ ], but [[ ]] does not
+   split words and keeps it as an empty one. */
+static int parse_test ( parser *p )
+{
+    lua_State *L = p->L;
+    const char *close = "]";
+    int n = 0, result = 0, keep_empty = 0;
+
+    if ( at_keyword( p, "[[" )) close = "]]", keep_empty = 1;
+    else if ( ! at_keyword( p, "[" )) fail( p, "unsupported condition" );
+    p->pos += strlen( close );
+    luaL_checkstack( L, 4, "too many nested statements" );
+
+    for (;;) {
+        const char *before;
+        int type;
+
+        skip_blanks( p );
+        if ( at_keyword( p, close )) {
+            p->pos += strlen( close );
+            break;
+        }
+        before = p->pos;
+        type   = read_word( p, 1 );
+        if ( p->pos == before || type == WORD_SPLICE || n == 3 ) {
+            fail( p, "unsupported test" );
+        }
+        if ( type == WORD_TEXT || keep_empty ) {
+            lua_pushlstring( L, p->buf, p->len );
+            ++n;
+        }
+    }
+
+    if ( n == 3 ) {
+        const char *op = lua_tostring( L, -2 );
+        int equal = lua_rawequal( L, -3, -1 );
+
+        if ( strcmp( op, "=" ) == 0 || strcmp( op, "==" ) == 0 ) result = equal;
+        else if ( strcmp( op, "!=" ) == 0 ) result = ! equal;
+        else fail( p, "unsupported test" );
+    }
+    else if ( n == 2 ) {
+        const char *op = lua_tostring( L, -2 );
+        size_t len = lua_objlen( L, -1 );
+
+        if ( strcmp( op, "-n" ) == 0 ) result = len > 0;
+        else if ( strcmp( op, "-z" ) == 0 ) result = len == 0;
+        else fail( p, "unsupported test" );
+    }
+    else if ( n == 1 ) {
+        result = lua_objlen( L, -1 ) > 0;
+    }
+    lua_pop( L, n );
+
+    return result;
+}
+
+static void parse_list ( parser *p, int run, const char *const *stops );
+
+static void parse_statement ( parser *p, int run );
+
+static void expect_keyword ( parser *p, const char *keyword )
+{
+    skip_space( p );
+    if ( ! at_keyword( p, keyword )) fail( p, "unsupported syntax" );
+    p->pos += strlen( keyword );
+}
+
+static void parse_if ( parser *p, int run )
+{
+    static const char *const branch_end[] = { "elif", "else", "fi", NULL };
+    static const char *const if_end[]     = { "fi", NULL };
+    int done = 0, cond;
+
+    p->pos += 2; /* if */
+    for (;;) {
+        skip_blanks( p );
+        cond = parse_test( p );
+        skip_blanks( p );
+        if ( peek( p, 0 ) == ';' ) ++p->pos;
+        expect_keyword( p, "then" );
+
+        parse_list( p, run && ! done && cond, branch_end );
+        done = done || cond;
+
+        if ( at_keyword( p, "elif" )) {
+            p->pos += 4;
+            continue;
+        }
+        if ( at_keyword( p, "else" )) {
+            p->pos += 4;
+            parse_list( p, run && ! done, if_end );
+        }
+        expect_keyword( p, "fi" );
+        break;
+    }
+    end_statement( p );
+}
+
+static void parse_case ( parser *p, int run )
+{
+    static const char *const case_end[] = { "esac", NULL };
+    lua_State *L = p->L;
+    int done = 0;
+
+    p->pos += 4; /* case */
+    skip_blanks( p );
+    if ( read_word( p, 1 ) != WORD_TEXT ) fail( p, "unsupported case" );
+    luaL_checkstack( L, 2, "too many nested statements" );
+    lua_pushlstring( L, p->buf, p->len );
+    expect_keyword( p, "in" );
+
+    for (;;) {
+        int matched = 0;
+
+        skip_space( p );
+        if ( at_keyword( p, "esac" )) {
+            p->pos += 4;
+            break;
+        }
+        if ( peek( p, 0 ) == '(' ) ++p->pos;
+
+        for (;;) {
+            skip_blanks( p );
+            if ( peek( p, 0 ) == '*' && strchr( " \t|)", peek( p, 1 ))) {
+                ++p->pos;
+                matched = 1;
+            }
+            else {
+                const char *before = p->pos;
+                int type = read_word( p, 1 );
+                if ( p->pos == before || type == WORD_SPLICE ) {
+                    fail( p, "unsupported case pattern" );
+                }
+                lua_pushlstring( L, p->buf, p->len );
+                matched = matched || lua_rawequal( L, -1, -2 );
+                lua_pop( L, 1 );
+            }
+
+            skip_blanks( p );
+            if ( peek( p, 0 ) == '|' ) {
+                ++p->pos;
+                continue;
+            }
+            if ( peek( p, 0 ) != ')' ) fail( p, "unsupported case pattern" );
+            ++p->pos;
+            break;
+        }
+
+        parse_list( p, run && ! done && matched, case_end );
+        done = done || matched;
+
+        skip_space( p );
+        if ( peek( p, 0 ) == ';' && peek( p, 1 ) == ';' ) {
+            p->pos += 2;
+            if ( peek( p, 0 ) == '&' ) fail( p, "unsupported case fallthrough" );
+        }
+        else if ( ! at_keyword( p, "esac" )) {
+            fail( p, "unsupported case" );
+        }
+    }
+    lua_pop( L, 1 );
+    end_statement( p );
+}
+
+static void parse_statement ( parser *p, int run )
+{
+    size_t len;
+
+    /* Not decremented when we fail, but then we are done anyway. */
+    if ( ++p->depth > MAX_DEPTH ) fail( p, "statements nested too deeply" );
+
+    if ( at_keyword( p, "if" )) {
+        parse_if( p, run );
+    }
+    else if ( at_keyword( p, "case" )) {
+        parse_case( p, run );
+    }
+    else if ( at_keyword( p, "function" )) {
+        p->pos += 8;
+        skip_blanks( p );
+        parse_function( p );
+    }
+    else if ( at_keyword( p, "[" ) || at_keyword( p, "[[" )) {
+        int cond = parse_test( p );
+
+        skip_blanks( p );
+        if ( peek( p, 0 ) == '&' && peek( p, 1 ) == '&' ) {
+            p->pos += 2;
+        }
+        else if ( peek( p, 0 ) == '|' && peek( p, 1 ) == '|' ) {
+            p->pos += 2;
+            cond = ! cond;
+        }
+        else fail( p, "unsupported use of a test" );
+
+        skip_space( p );
+        parse_statement( p, run && cond );
+    }
+    else if ( ( len = name_len( p )) > 0 ) {
+        if ( peek( p, len ) == '=' ||
+             ( peek( p, len ) == '+' && peek( p, len + 1 ) == '=' )) {
+            /* There may be several assignments on a line. */
+            do {
+                parse_assignment( p, run, len );
+                skip_blanks( p );
+                len = name_len( p );
+            } while ( len > 0 && ( peek( p, len ) == '=' ||
+                                   ( peek( p, len ) == '+' &&
+                                     peek( p, len + 1 ) == '=' )));
+            end_statement( p );
+        }
+        else {
+            parse_function( p );
+        }
+    }
+    else fail( p, "unsupported command" );
+    --p->depth;
+}
+
+/* Parses statements until the end of the text, a ;; or one of the
+   keywords in stops (left for the caller). */
+static void parse_list ( parser *p, int run, const char *const *stops )
+{
+    const char *const *stop;
+
+    for (;;) {
+        skip_space( p );
+        if ( peek( p, 0 ) == ';' && peek( p, 1 ) != ';' ) {
+            ++p->pos;
+            continue;
+        }
+        if ( peek( p, 0 ) == EOF ) {
+            if ( stops ) fail( p, "unexpected end of the file" );
+            return;
+        }
+        if ( peek( p, 0 ) == ';' ) return;
+        for ( stop = stops ; stop && *stop ; ++stop ) {
+            if ( at_keyword( p, *stop )) return;
+        }
+        parse_statement( p, run );
+    }
+}
+
+static int parse_protected ( lua_State *L )
+{
+    parser *p = lua_touserdata( L, 1 );
+
+    p->L = L;
+    lua_newtable( L );
+    p->vars = lua_gettop( L );
+
+    /* Preset variables, like CARCH, are given as plain strings. */
+    if ( lua_istable( L, 2 )) {
+        lua_pushnil( L );
+        while ( lua_next( L, 2 )) {
+            lua_createtable( L, 1, 0 );
+            lua_insert( L, -2 );
+            lua_rawseti( L, -2, 1 );
+            lua_pushvalue( L, -2 );
+            lua_insert( L, -2 );
+            lua_rawset( L, p->vars );
+        }
+    }
+
+    parse_list( p, 1, NULL );
+    lua_pushvalue( L, p->vars );
+    return 1;
+}
+
+/* parse( text [, presets] ) returns a table mapping the name of each
+   variable text sets to the list of its values (a single one for
+   strings), or nil and why text could not be parsed. */
+static int bashvars_parse ( lua_State *L )
+{
+    parser p;
+    size_t len;
+    int status;
+
+    memset( &p, 0, sizeof p );
+    p.start = p.pos = luaL_checklstring( L, 1, &len );
+    p.end   = p.start + len;
+
+    lua_pushcfunction( L, parse_protected );
+    lua_pushlightuserdata( L, &p );
+    lua_pushvalue( L, 2 );
+    status = lua_pcall( L, 2, 1, 0 );
+    free( p.buf );
+
+    if ( status != 0 ) {
+        lua_pushnil( L );
+        lua_insert( L, -2 );
+        return 2;
+    }
+    return 1;
+}
+
+static luaL_Reg const pkg_funcs[] = {
+    { "parse",                      bashvars_parse },
+    { NULL,                         NULL }
+};
+
+int luaopen_clydelib_bashvars ( lua_State *L )
+{
+    lua_newtable( L );
+    luaL_register( L, NULL, pkg_funcs );
+
+    return 1;
+}
@@ -0,0 +1,164 @@
+module(..., package.seeall)
+---running makepkg as the build user---
+local utilcore = require "clydelib.utilcore"
+local signal   = require "clydelib.signal"
+local cache    = require "clydelib.cache"
+
+--[[ When we are root and BuildUser is not, start() forks a helper
+     which gives up root for the build user's uid and gid for good.
+     spawn() sends it jobs over a pipe; it runs each one at once, with
+     no shell in between, and reports back over another pipe when it
+     exits, which wait() returns. Several jobs can run at a time.
+
+     Otherwise spawn() and wait() run the jobs themselves, as whoever
+     we are. Either way spawn() takes the same arguments as
+     utilcore.spawn() and wait() returns a job's id and exit status.
+
+     Jobs go to the helper as a line with the length of the job's
+     table serialized as Lua, followed by it; reports come back as
+     lines of "id status". The helper sleeps in poll() until a job
+     comes or one exits, which SIGCHLD tells it through a pipe.
+
+     The helper is a fork of clyde, so it lets go of every fd it got
+     from us (the AUR connections, libalpm's log) but its pipes before
+     it becomes the build user. ]]--
+
+local helper -- { pid, jobfd, replyfd, buffer, nextid }, in the parent
+
+-- Takes the messages at the start of buffer, a length line followed by
+-- a serialized table, and returns the tables and what is left.
+local function decode ( buffer )
+    local jobs = {}
+    while true do
+        local len, start = buffer:match( "^(%d+)\n()" )
+        if not len or #buffer < start + len - 1 then break end
+
+        local chunk = assert( loadstring( buffer:sub( start, start + len - 1 )))
+        setfenv( chunk, {} )
+        table.insert( jobs, chunk())
+        buffer = buffer:sub( start + len )
+    end
+    return jobs, buffer
+end
+
+local function encode ( job )
+    local text = "return " .. cache.serialize( job )
+    return #text .. "\n" .. text
+end
+
+-- The helper's side: runs jobs from jobfd as user until it is closed
+-- and every job exited.
+local function serve ( jobfd, replyfd, user )
+    signal.signal( "SIGINT", "default" )
+    signal.signal( "SIGTERM", "default" )
+
+    local chldfd = utilcore.sigchldfd()
+    utilcore.closefds{ jobfd, replyfd }
+
+    local pw = utilcore.getpwnam( user.name )
+    utilcore.setids( user.uid, user.gid, user.name )
+    local userenv = { HOME = pw and pw.dir or "/"; USER = user.name;
+                      LOGNAME = user.name }
+
+    local running, nrunning, buffer, open = {}, 0, "", true
+    while open or nrunning > 0 do
+        local ready = utilcore.poll( open and { jobfd, chldfd } or { chldfd } )
+        if ready[ jobfd ] then
+            local data = utilcore.read( jobfd )
+            if data == "" then open = false end
+
+            local jobs
+            jobs, buffer = decode( buffer .. data )
+            for i, job in ipairs( jobs ) do
+                local opts = job.opts
+                opts.env = opts.env or {}
+                for name, value in pairs( userenv ) do
+                    opts.env[ name ] = opts.env[ name ] or value
+                end
+
+                local ok, pid = pcall( utilcore.spawn, job.argv, opts )
+                if ok then
+                    running[ pid ] = job.id
+                    nrunning = nrunning + 1
+                else
+                    io.stderr:write( "clyde: ", pid, "\n" )
+                    utilcore.write( replyfd, job.id .. " 127\n" )
+                end
+            end
+        end
+
+        if ready[ chldfd ] then
+            utilcore.drain( chldfd )
+            while nrunning > 0 do
+                local pid, status = utilcore.waitpid( -1, true )
+                if not pid then break end
+                if running[ pid ] then
+                    utilcore.write( replyfd,
+                                    running[ pid ] .. " " .. status .. "\n" )
+                    running[ pid ] = nil
+                    nrunning = nrunning - 1
+                end
+            end
+        end
+    end
+end
+
+--[[ Forks the helper which runs jobs as user (a table with name, uid
+     and gid, like aur.get_builduser() returns), if we are root and
+     user is not and there is no helper yet. ]]--
+function start ( user )
+    if helper or utilcore.geteuid() ~= 0 or user.uid == 0 then return end
+
+    local jobr, jobw     = utilcore.pipe()
+    local replyr, replyw = utilcore.pipe()
+    local pid = utilcore.fork()
+    if pid == 0 then
+        utilcore.close( jobw )
+        utilcore.close( replyr )
+        local ok, err = pcall( serve, jobr, replyw, user )
+        if not ok then io.stderr:write( "clyde: build helper: ", err, "\n" ) end
+        utilcore.exit( ok and 0 or 1 )
+    end
+
+    utilcore.close( jobr )
+    utilcore.close( replyw )
+    helper = { pid = pid; jobfd = jobw; replyfd = replyr; buffer = "";
+               nextid = 0 }
+end
+
+-- Starts argv with opts like utilcore.spawn() and returns its job id.
+function spawn ( argv, opts )
+    if not helper then return utilcore.spawn( argv, opts ) end
+
+    helper.nextid = helper.nextid + 1
+    utilcore.write( helper.jobfd, encode( { id = helper.nextid; argv = argv;
+                                            opts = opts or {} } ))
+    return helper.nextid
+end
+
+--[[ Waits for any job to exit and returns its id and exit status, or
+     nil and a message if there is nothing to wait for. ]]--
+function wait ()
+    if not helper then return utilcore.waitpid() end
+
+    while true do
+        local id, status, rest = helper.buffer:match( "^(%d+) (%d+)\n(.*)$" )
+        if id then
+            helper.buffer = rest
+            return tonumber( id ), tonumber( status )
+        end
+
+        local data = utilcore.read( helper.replyfd )
+        if data == "" then return nil, "the build helper exited" end
+        helper.buffer = helper.buffer .. data
+    end
+end
+
+-- Tells the helper to exit once its jobs are done and waits for it.
+function stop ()
+    if not helper then return end
+    utilcore.close( helper.jobfd )
+    utilcore.close( helper.replyfd )
+    utilcore.waitpid( helper.pid )
+    helper = nil
+end
@@ -0,0 +1,104 @@
+module(..., package.seeall)
+---keeping things we fetched on disk---
+local lfs      = require "lfs"
+local url      = require "socket.url"
+local utilcore = require "clydelib.utilcore"
+local util     = require "clydelib.util"
+local lprintf  = util.lprintf
+
+--[[ Entries are Lua tables stored one per file, as Lua source, under a
+     subdirectory of the cache dir. The cache dir can be set with
+     AurCacheDir in clyde.conf. If we can't create or write to it (say
+     we are not root) the cache is still read but nothing is stored. ]]--
+
+local DEFAULT_CACHEDIR = "/var/cache/clyde"
+local MAX_KEYLEN       = 200 -- longer keys would make too long file names
+
+function get_cachedir ()
+    return config.aurcachedir or DEFAULT_CACHEDIR
+end
+
+function subdir_path ( subdir )
+    return get_cachedir() .. "/" .. subdir
+end
+
+local function entry_path ( subdir, key )
+    if #key > MAX_KEYLEN then return nil end
+    return subdir_path( subdir ) .. "/" .. url.escape( key )
+end
+
+-- Returns true if entries can be stored in subdir, creating it if needed.
+local can_write = {}
+function writable ( subdir )
+    if can_write[ subdir ] ~= nil then return can_write[ subdir ] end
+
+    local ok = true
+    for i, dir in ipairs{ get_cachedir(), subdir_path( subdir ) } do
+        if ok and not lfs.attributes( dir, "mode" ) then
+            ok = pcall( utilcore.mkdir, dir, "0755" )
+        end
+    end
+    ok = ok and utilcore.access( subdir_path( subdir ), "W_OK" ) == 0
+
+    if not ok then
+        lprintf( "LOG_DEBUG", "cache: %s is read-only\n",
+                 subdir_path( subdir ))
+    end
+    can_write[ subdir ] = ok
+    return ok
+end
+
+-- Turns strings, numbers, booleans and tables of them into Lua source.
+function serialize ( value )
+    local t = type( value )
+    if t == "string" then return string.format( "%q", value )
+    elseif t == "number" or t == "boolean" then return tostring( value )
+    elseif t ~= "table" then
+        error( "cannot serialize a " .. t .. " value" )
+    end
+
+    local fields = {}
+    for k, v in pairs( value ) do
+        table.insert( fields, "[" .. serialize( k ) .. "]="
+                      .. serialize( v ))
+    end
+    return "{" .. table.concat( fields, ",\n" ) .. "}"
+end
+
+-- Returns the entry stored under key or nil.
+function load ( subdir, key )
+    local path = entry_path( subdir, key )
+    if not path then return nil end
+
+    local chunk = loadfile( path )
+    if not chunk then return nil end
+
+    setfenv( chunk, {} )
+    local ok, entry = pcall( chunk )
+    if not ok or type( entry ) ~= "table" then
+        lprintf( "LOG_DEBUG", "cache: ignoring broken entry %s\n", path )
+        return nil
+    end
+    return entry
+end
+
+-- Stores entry under key. Returns true if it was written.
+function store ( subdir, key, entry )
+    local path = entry_path( subdir, key )
+    if not path or not writable( subdir ) then return false end
+
+    -- Write to a temporary file and move it into place, so that readers
+    -- never see half of an entry.
+    local tmppath = path .. ".tmp"
+    local fh = io.open( tmppath, "w" )
+    if not fh then return false end
+    fh:write( "return ", serialize( entry ), "\n" )
+    fh:close()
+
+    return os.rename( tmppath, path ) and true or false
+end
+
+function remove ( subdir, key )
+    local path = entry_path( subdir, key )
+    if path then os.remove( path ) end
+end
@@ -3,10 +3,12 @@ local util = require "clydelib.util"
 local utilcore = require "clydelib.utilcore"
 local alpm = require "lualpm"
 local socket = require "socket"
+local lfs = require "lfs"
 colorize = require "clydelib.colorize"
 local C = colorize
 local g = utilcore.gettext
 local printf = util.printf
+local eprintf = util.eprintf
 local vfprintf = util.vfprintf
 local getcols = util.getcols
 local yesno = util.yesno
@@ -628,3 +630,47 @@ function create_xfercmd_cb ( cmd )
                return 0
            end
 end    
+
+--[[ Creates a fetch callback which downloads http and https URLs with
+     our own HTTP code, so interrupted downloads resume from their .part
+     file and connections are reused. Other URLs are given to fallback,
+     if there is one. libalpm checks the packages once they are here. ]]--
+function create_fetch_cb ( fallback )
+    local aur = require "clydelib.aur"
+    return function ( url, localpath, force )
+               if not url:match( "^https?://" ) then
+                   if fallback then return fallback( url, localpath, force ) end
+                   eprintf( "LOG_ERROR", g("cannot download %s\n"), url )
+                   return -1
+               end
+
+               local filename = url:match( "^.*/(.*)$" )
+               if not filename then
+                   error( "Could not extract filename from url: " .. url )
+               end
+
+               local destfile = localpath .. filename
+               if force then
+                   os.remove( destfile .. ".part" )
+                   os.remove( destfile .. ".part.validator" )
+               end
+
+               -- Databases are only fetched again if they changed.
+               local since = not force and
+                   lfs.attributes( destfile, "modification" )
+               local function progress ( xfered, total )
+                   cb_dl_progress( filename, xfered, total )
+               end
+
+               local code, err = aur.http_download( url, destfile,
+                                                    { since    = since,
+                                                      progress = progress } )
+               if not code then
+                   eprintf( "LOG_ERROR", g("failed retrieving file '%s' (%s)\n"),
+                            filename, tostring( err ))
+                   return -1
+               end
+               return code == 304 and 1 or 0
+           end
+end
+
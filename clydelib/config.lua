@@ -10,6 +10,23 @@ return {
 ['editor'] = nil;
 ['op_g_get_deps'] = false;
 ['op_s_build_user'] = false;
+['aur_url'] = false;
+['aur_cafile'] = false;
+['aur_pipeline'] = false;
+['aur_concurrency'] = 4;
+['aur_connect_timeout'] = 10;
+['aur_timeout'] = 30;
+['aur_nohedge'] = false;
+['aurcachedir'] = false;
+['artifact_store'] = false;
+['artifact_store_size'] = 4096;
+['local_repo'] = false;
+['rpc_cache_ttl'] = 600;
+['offline'] = false;
+['aur_index'] = false;
+['complete'] = false;
+['internal_download'] = false;
+['xfercommand'] = false;
     --[[
     --pacman feature functions
     --]]
@@ -29,6 +46,9 @@ return {
 ['dbpath'] = false;
 ['logfile'] = false;
 ['builddir'] = false;
+['build_jobs'] = 1;
+['make_jobs'] = false;
+['fetch_ahead'] = 2;
 --	/* TODO how to handle cachedirs? */
 ['op_q_isfile'] = false;
 ['op_q_info'] = 0;
@@ -50,6 +70,7 @@ return {
 ['op_s_search'] = false;
 ['op_s_upgrade'] = 0;
 ['op_s_printuris'] = false;
+['op_s_plan'] = false;
 
 ['group'] = 0;
 --	pmtransflag_t flags;
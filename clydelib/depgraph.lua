@@ -0,0 +1,233 @@
+module(..., package.seeall)
+---the dependency graph of packages we build---
+
+--[[ A graph has a node for each package we need: the targets and,
+     recursively, each of their dependencies which is not installed
+     yet. Edges point from a package to the dependencies it waits on.
+
+     index is a satisfier index (see alpm.satisfier_new) which knows
+     what is installed, tagged "local", and what the repos have, tagged
+     "sync". The graph adds the packages it plans to build, tagged
+     "plan". A dependency like "foo>=1" leads to whichever package
+     satisfies it: nothing if an installed one does, else a planned
+     package, else a repo package, else the AUR package named foo.
+     depsfn( name ) returns the dependencies of a package as a list of
+     such strings and, when it knows them, the package's version and
+     what it provides.
+
+     Everything is looked up in hash tables and the dependencies of
+     each package are only asked for once, so resolving is linear in
+     the number of packages and edges. As packages get installed,
+     provide() updates the graph in place instead of resolving again. ]]--
+
+local graphmt = {}
+graphmt.__index = graphmt
+
+function new ( index, depsfn )
+    return setmetatable( { index    = index;
+                           depsfn   = depsfn;
+                           nodes    = {};   -- name => node
+                           order    = {};   -- names, as they were found
+                           targets  = {} }, -- name => true
+                         graphmt )
+end
+
+-- Strips the version requirement from a dependency string.
+function depname ( dep )
+    return dep:match( "^([^<>=]+)" )
+end
+
+local function add_node ( graph, name )
+    local node = { name    = name;
+                   deps    = {};  -- names of the packages we depend on
+                   depset  = {};  -- the same, as a set
+                   rdeps   = {};  -- names of the packages depending on us
+                   waiting = {};  -- dep name => the dependency string,
+                                  -- while it is not satisfied
+                   missing = 0 }  -- how many deps we are waiting on
+    graph.nodes[ name ] = node
+    table.insert( graph.order, name )
+    return node
+end
+
+-- Returns the name of the package a dependency leads to, or nil if
+-- it is satisfied by an installed package.
+local function provider ( graph, dep )
+    local name = depname( dep )
+    if not name
+        or graph.index:find( dep, "local" ) and not graph.targets[ name ] then
+        return nil
+    end
+
+    -- Packages still in the queue are not in the index yet.
+    return graph.index:find( dep, "plan" )
+        or ( graph.nodes[ name ] and name )
+        or graph.index:find( dep, "sync" )
+        or name
+end
+
+--[[ Adds targets to the graph along with everything they need. A
+     dependency which is already installed is left out, unless it is a
+     target itself: then it will be installed again first. ]]--
+function graphmt:resolve ( targets )
+    for i, name in ipairs( targets ) do self.targets[ name ] = true end
+
+    local queue, head = {}, 1
+    for i, name in ipairs( targets ) do
+        if not self.nodes[ name ] then
+            table.insert( queue, add_node( self, name ))
+        end
+    end
+
+    while queue[ head ] do
+        local node = queue[ head ]
+        head = head + 1
+
+        local deps, version, provides = self.depsfn( node.name )
+        if version then
+            self.index:add( node.name, version, provides or {}, "plan" )
+        end
+
+        for i, dep in ipairs( deps or {} ) do
+            local name = provider( self, dep )
+            if name and name ~= node.name and not node.depset[ name ] then
+                local depnode = self.nodes[ name ]
+                if not depnode then
+                    depnode = add_node( self, name )
+                    table.insert( queue, depnode )
+                end
+
+                node.depset[ name ] = true
+                table.insert( node.deps, name )
+                table.insert( depnode.rdeps, node.name )
+                if not depnode.done then
+                    node.waiting[ name ] = dep
+                    node.missing = node.missing + 1
+                end
+            end
+        end
+    end
+
+    return self.order
+end
+
+-- Returns true if every dependency of the package is satisfied.
+function graphmt:ready ( name )
+    local node = self.nodes[ name ]
+    return not node or node.missing == 0
+end
+
+-- Returns the dependencies of a package which are not satisfied yet,
+-- as they were asked for.
+function graphmt:missing ( name )
+    local node, missing = self.nodes[ name ], {}
+    for i, dep in ipairs( node.deps ) do
+        if node.waiting[ dep ] then
+            table.insert( missing, node.waiting[ dep ] )
+        end
+    end
+    return missing
+end
+
+--[[ Records that name was installed with the given version and
+     provides. Returns the packages which became ready because of it.
+     A package waiting on a version which was not installed keeps
+     waiting, until name is provided again with a newer one. ]]--
+function graphmt:provide ( name, version, provides )
+    self.index:add( name, version, provides or {}, "local" )
+
+    local node, ready = self.nodes[ name ], {}
+    if not node then return ready end
+    node.done = true
+
+    for i, rdep in ipairs( node.rdeps ) do
+        local rnode = self.nodes[ rdep ]
+        local dep   = rnode.waiting[ name ]
+        if dep and self.index:find( dep, "local" ) then
+            rnode.waiting[ name ] = nil
+            rnode.missing = rnode.missing - 1
+            if rnode.missing == 0 then table.insert( ready, rdep ) end
+        end
+    end
+    return ready
+end
+
+-- Follows edges from name among the nodes in left until a node repeats
+-- and returns that cycle, like { "a", "b", "a" }.
+local function find_cycle ( graph, name, left )
+    local seen, path = {}, {}
+    while not seen[ name ] do
+        seen[ name ] = #path + 1
+        table.insert( path, name )
+        for i, dep in ipairs( graph.nodes[ name ].deps ) do
+            if left[ dep ] then name = dep; break end
+        end
+    end
+
+    local cycle = {}
+    for i = seen[ name ], #path do table.insert( cycle, path[i] ) end
+    table.insert( cycle, name )
+    return cycle
+end
+
+--[[ Returns every package in the graph with dependencies before the
+     packages that need them. Packages which do not depend on each
+     other keep the order they were found in. If some packages depend
+     on each other in a circle, returns nil and one such cycle. ]]--
+function graphmt:toposort ()
+    local indegree, queue, head = {}, {}, 1
+    for i, name in ipairs( self.order ) do
+        indegree[ name ] = #self.nodes[ name ].deps
+        if indegree[ name ] == 0 then table.insert( queue, name ) end
+    end
+
+    local sorted = {}
+    while queue[ head ] do
+        local name = queue[ head ]
+        head = head + 1
+        table.insert( sorted, name )
+
+        for i, rdep in ipairs( self.nodes[ name ].rdeps ) do
+            indegree[ rdep ] = indegree[ rdep ] - 1
+            if indegree[ rdep ] == 0 then table.insert( queue, rdep ) end
+        end
+    end
+
+    if #sorted < #self.order then
+        -- Whatever is left is on a cycle or waits on one.
+        local left, first = {}, nil
+        for i, name in ipairs( self.order ) do
+            if indegree[ name ] > 0 then
+                left[ name ] = true
+                first = first or name
+            end
+        end
+        return nil, find_cycle( self, first, left )
+    end
+
+    return sorted
+end
+
+--[[ Groups the packages into waves: each package is in the wave after
+     the last of its dependencies, so the packages of a wave can be
+     built at the same time. Packages for which skip( name ) is true
+     are left out, as if they were installed first. Returns nil and a
+     cycle like toposort() if there is one. ]]--
+function graphmt:waves ( skip )
+    local sorted, cycle = self:toposort()
+    if not sorted then return nil, cycle end
+
+    local level, waves = {}, {}
+    for i, name in ipairs( sorted ) do
+        if not ( skip and skip( name )) then
+            local wave = 1
+            for j, dep in ipairs( self.nodes[ name ].deps ) do
+                if level[ dep ] then wave = math.max( wave, level[ dep ] + 1 ) end
+            end
+            level[ name ] = wave
+            waves[ wave ] = waves[ wave ] or {}
+            table.insert( waves[ wave ], name )
+        end
+    end
+    return waves
+end
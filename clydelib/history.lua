@@ -0,0 +1,74 @@
+module(..., package.seeall)
+---how long building AUR packages took before---
+local lfs      = require "lfs"
+local util     = require "clydelib.util"
+local cache    = require "clydelib.cache"
+local lprintf  = util.lprintf
+
+--[[ Each build the pipeline finishes is recorded in the "history"
+     cache subdirectory, under the package's name: the wall time of
+     makepkg, the disk space its dir took once it finished (close to
+     the most it used, unless makepkg was told to clean up) and the
+     size of the packages it made. The last KEEP builds are kept and
+     estimates are their averages. ]]--
+
+local SUBDIR = "history"
+local KEEP   = 5
+
+local entries = {} -- pkgname => entry or false, for this run
+
+local function load_entry ( pkgname )
+    if entries[ pkgname ] == nil then
+        entries[ pkgname ] = cache.load( SUBDIR, pkgname ) or false
+    end
+    return entries[ pkgname ] or nil
+end
+
+-- Returns how many bytes the files under path take, not following
+-- symlinks.
+function disk_usage ( path )
+    local attr = lfs.symlinkattributes( path )
+    if not attr then return 0 end
+    if attr.mode ~= "directory" then return attr.size end
+
+    local total = 0
+    for file in lfs.dir( path ) do
+        if file ~= "." and file ~= ".." then
+            total = total + disk_usage( path .. "/" .. file )
+        end
+    end
+    return total
+end
+
+--[[ Records a build of pkgname. run has the seconds it took as time,
+     the bytes its dir took as disk and the bytes of its packages as
+     size. ]]--
+function record ( pkgname, run )
+    local entry = load_entry( pkgname ) or { runs = {} }
+    table.insert( entry.runs, { time = run.time; disk = run.disk;
+                                size = run.size; date = os.time() } )
+    while #entry.runs > KEEP do table.remove( entry.runs, 1 ) end
+
+    entries[ pkgname ] = entry
+    if not cache.store( SUBDIR, pkgname, entry ) then
+        lprintf( "LOG_DEBUG", "history: could not record %s\n", pkgname )
+    end
+end
+
+--[[ Returns the average time, disk and size of the builds of pkgname
+     we know of, along with how many there were as runs, or nil if it
+     was never built. ]]--
+function estimate ( pkgname )
+    local entry = load_entry( pkgname )
+    if not entry or not next( entry.runs ) then return nil end
+
+    local sum = { time = 0; disk = 0; size = 0 }
+    for i, run in ipairs( entry.runs ) do
+        for field in pairs( sum ) do
+            sum[ field ] = sum[ field ] + ( run[ field ] or 0 )
+        end
+    end
+    for field in pairs( sum ) do sum[ field ] = sum[ field ] / #entry.runs end
+    sum.runs = #entry.runs
+    return sum
+end
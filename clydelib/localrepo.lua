@@ -0,0 +1,144 @@
+module(..., package.seeall)
+---a pacman repository of the AUR packages we built---
+local lfs      = require "lfs"
+local alpm     = require "lualpm"
+local utilcore = require "clydelib.utilcore"
+local util     = require "clydelib.util"
+local lprintf  = util.lprintf
+
+--[[ LocalRepo in clyde.conf names a directory which clyde keeps as a
+     pacman repository: every AUR package it installs is copied there
+     and added to the database with repo-add. The repository is
+     registered as the sync database NAME, so reinstalling a package we
+     built, or needing it as a dependency, goes through libalpm like
+     any other repo package instead of building it again.
+
+     The repository only holds what we built; it is not where packages
+     come from. Installed packages found only in it are still foreign
+     (for -Qm and for finding AUR upgrades), and once the AUR has a
+     newer version than is installed, outdate() hides the package in
+     the repository so that it gets built. ]]--
+
+NAME = "clyde-local"
+
+local DBEXT = ".db.tar.gz"
+local LOG   = "repo-add.log"
+
+local repodb  -- the registered sync database
+local hidden = {} -- pkgname => true, for packages to build anyway
+
+function enabled ()
+    return config.local_repo and true or false
+end
+
+local function db_file ()
+    return config.local_repo .. "/" .. NAME .. DBEXT
+end
+
+-- Runs a command without a shell, its output going to the log in the
+-- repository. Returns true or nil and a message.
+local function run ( argv )
+    local log = config.local_repo .. "/" .. LOG
+    local pid, status = utilcore.waitpid( utilcore.spawn( argv, { log = log } ))
+    if not pid then return nil, status end
+    if status ~= 0 then
+        return nil, string.format( "%s failed (%d), see %s", argv[1], status, log )
+    end
+    return true
+end
+
+-- Copies the repository's database into libalpm's sync dir, if it is
+-- newer. Needs root, like -Sy.
+local function refresh ()
+    if util.trans_init( {} ) == -1 then
+        return nil, alpm.strerrorlast()
+    end
+    local ret = repodb:db_update( false )
+    local err = alpm.strerrorlast()
+    util.trans_release()
+    if ret < 0 then return nil, err end
+    return true
+end
+
+--[[ Registers the repository as a sync database, once it has a
+     database, and brings libalpm's copy up to date if update is true.
+     pacman.conf may list the repository itself; then its section is
+     the one used. ]]--
+function register ( update )
+    if not enabled() then return end
+
+    if not repodb then
+        for i, db in ipairs( alpm.option_get_syncdbs()) do
+            if db:db_get_name() == NAME then repodb = db end
+        end
+    end
+    if not repodb then
+        if lfs.attributes( db_file(), "mode" ) ~= "file" then return end
+        repodb = alpm.db_register_sync( NAME )
+        if not repodb then
+            lprintf( "LOG_WARNING", "could not register '%s' database (%s)\n",
+                     NAME, alpm.strerrorlast())
+            return
+        end
+        repodb:db_setserver( "file://" .. config.local_repo )
+    end
+
+    if update then
+        local ok, err = refresh()
+        if not ok then
+            lprintf( "LOG_WARNING", "failed to update %s (%s)\n", NAME, err )
+        end
+    end
+end
+
+-- Returns true if db is our repository.
+function is_local ( db )
+    return repodb ~= nil and db:db_get_name() == NAME
+end
+
+-- Hides pkgname in the repository, because it must be built again.
+function outdate ( pkgname )
+    hidden[ pkgname ] = true
+end
+
+-- Returns true if pkgname in db must not be used.
+function outdated ( db, pkgname )
+    return hidden[ pkgname ] and is_local( db ) or false
+end
+
+--[[ Adds pkgfiles, the files of the packages pkgnames which were just
+     installed, to the repository in one go, replacing the files of the
+     versions it had before. Returns true or nil and a message. ]]--
+function add ( pkgnames, pkgfiles )
+    if not enabled() or not next( pkgfiles ) then return true end
+
+    if lfs.attributes( config.local_repo, "mode" ) ~= "directory" then
+        local ok, err = pcall( util.makepath, config.local_repo )
+        if not ok then return nil, err end
+    end
+
+    local copy, dests, stale = { "cp" }, {}, {}
+    for i, pkgfile in ipairs( pkgfiles ) do
+        local file = pkgfile:match( "([^/]+)$" )
+        table.insert( copy, pkgfile )
+        table.insert( dests, config.local_repo .. "/" .. file )
+
+        local old = repodb and repodb:db_get_pkg( pkgnames[i] )
+        local oldfile = old and old:pkg_get_filename()
+        if oldfile and oldfile ~= file then table.insert( stale, oldfile ) end
+    end
+    table.insert( copy, config.local_repo .. "/" )
+
+    local ok, err = run( copy )
+    if ok then ok, err = run( { "repo-add", db_file(), unpack( dests ) } ) end
+    if not ok then return nil, err end
+
+    for i, oldfile in ipairs( stale ) do
+        os.remove( config.local_repo .. "/" .. oldfile )
+    end
+    lprintf( "LOG_DEBUG", "localrepo: added %s\n", table.concat( pkgnames, " " ))
+
+    register( false )
+    if not repodb then return nil, "the repository is not registered" end
+    return refresh()
+end
@@ -3,6 +3,7 @@ local lfs = require "lfs"
 local util = require "clydelib.util"
 local utilcore = require "clydelib.utilcore"
 local aur = require "clydelib.aur"
+local pkgbuild = require "clydelib.pkgbuild"
 local ui = require "clydelib.ui"
 local printf = util.printf
 local eprintf = util.eprintf
@@ -156,24 +157,20 @@ function dump_pkg_full_aur(pkg, level)
         return
     end
     local reason, bdatestr, idatestr, bdate, idate, requiredby, depstrings
-    local pkgbuild = aur.pkgbuild_text(pkg)
-    assert(pkgbuild, "Failed to download PKGBUILD for " .. pkg)
-    local tmp = os.tmpname()
-    local tmpfile = io.open(tmp, "w")
-    tmpfile:write(pkgbuild)
-    tmpfile:close()
-    local carch = util.getbasharray("/etc/makepkg.conf", "CARCH")
+    local text = aur.pkgbuild_text(pkg)
+    assert(text, "Failed to download PKGBUILD for " .. pkg)
+    local info = pkgbuild.parse(text)
 
     local function gpa(field)
-        return util.getpkgbuildarray(carch, tmp, field)
+        return pkgbuild.field(info, field)
     end
 
     local function gpaopt(field)
-        return util.getpkgbuildarraylinebreak(carch, tmp, field)
+        return info[field]
     end
 
     local function gpat(field)
-        return strsplit(gpa(field), " ") or {}
+        return info[field]
     end
 
     string_display(C.bright("Name           :"), C.bright(pkg), bl)
@@ -193,7 +190,6 @@ function dump_pkg_full_aur(pkg, level)
     string_display(C.bright("Architecture   :"), gpa("arch"), bl)
     string_display(C.bright("Description    :"), gpa("pkgdesc"), bl)
     printf("\n")
-    os.remove(tmp)
 end
 
 function dump_pkg_sync_aur(pkg)
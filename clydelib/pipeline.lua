@@ -0,0 +1,273 @@
+module(..., package.seeall)
+---fetching, building and installing AUR packages at the same time---
+local lfs      = require "lfs"
+local socket   = require "socket"
+local utilcore = require "clydelib.utilcore"
+local util     = require "clydelib.util"
+local aur      = require "clydelib.aur"
+local artifacts = require "clydelib.artifacts"
+local history  = require "clydelib.history"
+local buildhelper = require "clydelib.buildhelper"
+local eprintf  = util.eprintf
+local lprintf  = util.lprintf
+local C        = colorize
+
+--[[ Once their AUR tarballs are extracted, packages go through three
+     stages which overlap as much as the dependencies allow:
+
+     fetch   makepkg -g downloads the sources in the PKGBUILD, up to
+             FetchAhead packages ahead of the builds, in the background.
+     build   makepkg builds a package once its sources are fetched and
+             its dependencies are installed, up to BuildJobs at once.
+             Of the packages which can start, those whose builds took
+             the longest before (see history) go first.
+     install the install function given to run() installs a wave of
+             built packages, those whose dependencies were installed,
+             in one go once none of the wave is left building or
+             ready to build. Fetches go on meanwhile; builds cannot,
+             whatever is left to build waits on the wave.
+
+     Packages found in the artifact store (see artifacts) skip fetching
+     and building, and what we build goes into the store.
+
+     makepkg runs as the build user through buildhelper, without a
+     shell. Fetches, and builds when there is more than one at a time,
+     run with their output in sources.log and makepkg.log next to each
+     package's dir. A single build keeps the terminal. ]]--
+
+local FETCH_ARGS = { "-g" }
+local BUILD_ARGS = { "-f" }
+
+-- Prints the last lines of a log, for when a stage failed.
+local function print_log_tail ( path, count )
+    local lines = {}
+    local file = io.open( path, "r" )
+    if not file then return end
+    for line in file:lines() do
+        table.insert( lines, line )
+        if #lines > count then table.remove( lines, 1 ) end
+    end
+    file:close()
+    for i, line in ipairs( lines ) do print( "    " .. line ) end
+end
+
+local function log_path ( pkg, name )
+    return pkg.dir:match( "^(.*)/" ) .. "/" .. name
+end
+
+--[[ Runs the stages for the AUR packages in order, a list of names
+     with dependencies first. dirs maps each name to its extracted
+     dir, graph (see depgraph) tells when a package's dependencies are
+     installed and install( names ) installs a list of built packages
+     and tells the graph. Exits clyde if a stage fails, once what was
+     already running is done. ]]--
+function run ( graph, order, dirs, install )
+    local slots  = config.build_jobs
+    local ahead  = config.fetch_ahead
+    local logged = slots > 1
+
+    -- Ask for anything before output goes to the logs.
+    local fetchargv = aur.makepkg_argv( FETCH_ARGS )
+    local buildargv = aur.makepkg_argv( BUILD_ARGS )
+    local jobs = math.max( 1, math.floor(
+                               ( config.make_jobs or utilcore.nprocs())
+                               / slots ))
+    local buildenv = { MAKEFLAGS = "-j" .. jobs }
+
+    local pkgs = {}
+    for i, name in ipairs( order ) do
+        local est = history.estimate( name )
+        local pkg = { name  = name;
+                      index = i;
+                      dir   = dirs[ name ];
+                      time  = est and est.time or 0;
+                      state = ahead > 0 and "new" or "fetched" }
+        pkgs[ name ] = pkg
+
+        if artifacts.enabled() then
+            pkg.key = artifacts.key( pkg.dir )
+            if pkg.key then
+                local restored = artifacts.restore( pkg.key, aur.pkgdest( name ))
+                if restored then
+                    print( C.greb( "==>" )
+                           .. C.bright( " Using the stored build of " .. name ))
+                    for i, file in ipairs( restored ) do
+                        aur.chown_builduser( aur.pkgdest( name ) .. "/" .. file )
+                    end
+                    pkg.state = "stored"
+                end
+            end
+        end
+    end
+
+    buildhelper.start( aur.get_builduser())
+    local running, nrunning, nfetching, nbuilding = {}, 0, 0, 0
+    local finished, failed = {}, nil
+
+    local function start ( pkg, state, argv, opts )
+        opts.dir, opts.umask = pkg.dir, "022"
+        -- The build user could not replace a log root left behind.
+        if opts.log then os.remove( opts.log ) end
+        local id = buildhelper.spawn( argv, opts )
+        running[ id ] = pkg
+        nrunning = nrunning + 1
+        pkg.state = state
+        pkg.started = socket.gettime()
+    end
+
+    local function longest_first ( a, b )
+        if a.time ~= b.time then return a.time > b.time end
+        return a.index < b.index
+    end
+
+    local function start_builds ()
+        local ready = {}
+        for i, name in ipairs( order ) do
+            local pkg = pkgs[ name ]
+            if pkg.state == "stored" and graph:ready( name ) then
+                pkg.state = "built"
+                table.insert( finished, name )
+            elseif pkg.state == "fetched" and graph:ready( name ) then
+                table.insert( ready, pkg )
+            end
+        end
+
+        table.sort( ready, longest_first )
+        for i, pkg in ipairs( ready ) do
+            if nbuilding >= slots then break end
+            local opts = { env = buildenv }
+            local msg = " Building " .. pkg.name
+            if logged then
+                opts.log = log_path( pkg, "makepkg.log" )
+                msg = msg .. " (" .. opts.log .. ")"
+            end
+            print( C.greb( "==>" ) .. C.bright( msg ))
+            start( pkg, "building", buildargv, opts )
+            nbuilding = nbuilding + 1
+        end
+    end
+
+    local function record_build ( pkg )
+        local dest, size = aur.pkgdest( pkg.name ), 0
+        for i, file in ipairs( artifacts.files( pkg.dir )) do
+            size = size + ( lfs.attributes( dest .. "/" .. file, "size" ) or 0 )
+        end
+        history.record( pkg.name, { time = socket.gettime() - pkg.started;
+                                    disk = history.disk_usage( pkg.dir );
+                                    size = size } )
+    end
+
+    -- Fetches go in build order, so the window of fetched packages
+    -- always holds the next one which can be built.
+    local function start_fetches ()
+        local pending = 0
+        for i, name in ipairs( order ) do
+            local pkg = pkgs[ name ]
+            if pkg.state == "fetching" or pkg.state == "fetched" then
+                pending = pending + 1
+            elseif pkg.state == "new" then
+                if pending >= ahead or nfetching >= config.aur_concurrency then
+                    return
+                end
+                start( pkg, "fetching", fetchargv,
+                       { log = log_path( pkg, "sources.log" ) } )
+                nfetching = nfetching + 1
+                pending = pending + 1
+            end
+        end
+    end
+
+    -- The wave is done when none of the packages which can be built
+    -- now is building or could start. After a failure nothing starts.
+    local function wave_done ()
+        if nbuilding > 0 then return false end
+        if failed then return true end
+        for i, name in ipairs( order ) do
+            local state = pkgs[ name ].state
+            if ( state == "fetched" or state == "stored" )
+                and graph:ready( name ) then
+                return false
+            end
+        end
+        return true
+    end
+
+    local function install_finished ()
+        local names = finished
+        finished = {}
+        install( names )
+        for i, name in ipairs( names ) do pkgs[ name ].state = "installed" end
+    end
+
+    local function fail ( pkg, what, log, status )
+        if log then
+            eprintf( "LOG_ERROR", "failed to %s %s, the end of %s:\n",
+                     what, pkg.name, log )
+            print_log_tail( log, 20 )
+        else
+            eprintf( "LOG_ERROR", "failed to %s %s\n", what, pkg.name )
+        end
+        failed = failed or status
+    end
+
+    local function wait_child ()
+        local id, status = buildhelper.wait()
+        if not id then error( "lost track of the builds: " .. status, 0 ) end
+        local pkg = running[ id ]
+        if not pkg then return end
+        running[ id ] = nil
+        nrunning = nrunning - 1
+
+        if pkg.state == "fetching" then
+            nfetching = nfetching - 1
+            if status == 0 then
+                pkg.state = "fetched"
+            else
+                fail( pkg, "fetch the sources of", log_path( pkg, "sources.log" ),
+                      status )
+            end
+        else
+            nbuilding = nbuilding - 1
+            if status == 0 then
+                if logged then
+                    print( C.greb( "==>" ) .. C.bright( " Built " .. pkg.name ))
+                end
+                pkg.state = "built"
+                table.insert( finished, pkg.name )
+                local ok, err = pcall( record_build, pkg )
+                if not ok then
+                    lprintf( "LOG_DEBUG", "pipeline: no history for %s: %s\n",
+                             pkg.name, err )
+                end
+                if pkg.key then
+                    local ok, err = artifacts.publish( pkg.key,
+                                                       aur.pkgdest( pkg.name ),
+                                                       artifacts.files( pkg.dir ))
+                    if not ok then
+                        eprintf( "LOG_WARNING", "could not store %s: %s\n",
+                                 pkg.name, err )
+                    end
+                end
+            else
+                fail( pkg, "build", logged and log_path( pkg, "makepkg.log" ),
+                      status )
+            end
+        end
+    end
+
+    while true do
+        if not failed then
+            start_builds()
+            start_fetches()
+        end
+        if next( finished ) and wave_done() then
+            install_finished()
+        else
+            if nrunning == 0 then break end
+            wait_child()
+        end
+    end
+
+    buildhelper.stop()
+    if failed then util.cleanup( failed ) end
+end
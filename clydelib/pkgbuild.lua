@@ -0,0 +1,114 @@
+module(..., package.seeall)
+---what is inside of a PKGBUILD---
+local utilcore = require "clydelib.utilcore"
+local bashvars = require "clydelib.bashvars"
+local util     = require "clydelib.util"
+local cache    = require "clydelib.cache"
+local lprintf  = util.lprintf
+
+--[[ parse() reads all of FIELDS out of a PKGBUILD at once, with
+     bashvars when the PKGBUILD is simple enough and by sourcing it with
+     bash otherwise. The result is kept by the SHA-256 of the PKGBUILD's
+     text (and CARCH, which the PKGBUILD may look at): in memory for
+     this run and in the "pkgbuild" cache subdirectory for the next
+     ones. A PKGBUILD which changed has another hash, so entries never
+     need to be expired; anyone can upload a PKGBUILD, so the hash must
+     be one nobody can make collide. ]]--
+
+FIELDS = { "pkgname", "pkgbase", "pkgver", "pkgrel", "epoch", "pkgdesc",
+           "url", "arch", "license", "groups", "depends", "makedepends",
+           "checkdepends", "optdepends", "provides", "conflicts",
+           "replaces", "install", "source" }
+
+local SUBDIR = "pkgbuild"
+
+-- Prints each field's name followed by its values, each value after a
+-- \037 (unit separator), and a \036 (record separator) after the field.
+-- This is given to bash -c so it must not contain single quotes.
+local EVAL_SCRIPT = [[
+CARCH=$1
+. "$2" &> /dev/null
+for field in @FIELDS@; do
+    eval "values=(\"\${$field[@]}\")"
+    printf %s "$field"
+    for value in "${values[@]}"; do printf "\037%s" "$value"; done
+    printf "\036"
+done]]
+
+local parsed = {} -- key => info, for this run
+
+local carch
+local function get_carch ()
+    carch = carch or util.getbasharray( "/etc/makepkg.conf", "CARCH" ) or ""
+    return carch
+end
+
+local function evaluate ( text )
+    local vars, err = bashvars.parse( text, { CARCH = get_carch() })
+    if vars then
+        local info = {}
+        for i, name in ipairs( FIELDS ) do info[ name ] = vars[ name ] or {} end
+        return info
+    end
+    lprintf( "LOG_DEBUG", "pkgbuild: asking bash, %s\n", err )
+
+    local tmp = os.tmpname()
+    local tmpfile = io.open( tmp, "w" )
+    tmpfile:write( text )
+    tmpfile:close()
+
+    local script = EVAL_SCRIPT:gsub( "@FIELDS@", table.concat( FIELDS, " " ))
+    local fd = io.popen( string.format( "/bin/bash -c '%s' clyde '%s' '%s'",
+                                        script, get_carch(), tmp ))
+    local output = fd:read( "*a" )
+    fd:close()
+    os.remove( tmp )
+
+    local info = {}
+    for record in output:gmatch( "([^\030]*)\030" ) do
+        local values = {}
+        for value in ( record .. "\031" ):gmatch( "([^\031]*)\031" ) do
+            table.insert( values, value )
+        end
+        local name = table.remove( values, 1 )
+        info[ name ] = values
+    end
+    if not next( info ) then return nil end
+
+    for i, name in ipairs( FIELDS ) do info[ name ] = info[ name ] or {} end
+    return info
+end
+
+-- Returns true if a cache entry has every field we need.
+local function complete ( info )
+    for i, name in ipairs( FIELDS ) do
+        if type( info[ name ] ) ~= "table" then return false end
+    end
+    return true
+end
+
+--[[ Returns the metadata of the PKGBUILD in text as a table mapping
+     each of FIELDS to the list of its values. Fields the PKGBUILD does
+     not set are empty lists. The table is shared, do not change it. ]]--
+function parse ( text )
+    local key = get_carch() .. "-" .. utilcore.sha256( text )
+    local info = parsed[ key ]
+    if info then return info end
+
+    info = cache.load( SUBDIR, key )
+    if not info or not complete( info ) then
+        info = evaluate( text )
+        if not info then error( "could not evaluate PKGBUILD", 0 ) end
+        lprintf( "LOG_DEBUG", "pkgbuild: evaluated %s\n",
+                 field( info, "pkgname" ))
+        cache.store( SUBDIR, key, info )
+    end
+
+    parsed[ key ] = info
+    return info
+end
+
+-- Returns a field's values as one string, separated by spaces.
+function field ( info, name )
+    return table.concat( info[ name ] or {}, " " )
+end
@@ -0,0 +1,111 @@
+module(..., package.seeall)
+---the package files in a PKGDEST directory---
+local lfs      = require "lfs"
+local alpm     = require "lualpm"
+local util     = require "clydelib.util"
+local cache    = require "clydelib.cache"
+local lprintf  = util.lprintf
+
+--[[ An index of a directory's package files by package name, made from
+     their file names (name-pkgver-pkgrel-arch.pkg.tar*) so that no
+     package has to be opened to find the newest build of a package.
+
+     The index of a directory is kept for this run, and in the
+     "pkgdest" cache subdirectory when the directory is big enough for
+     that to be quicker than listing it. Whenever the directory's mtime
+     changed, which any file added to or removed from it does, the
+     index is brought up to date from a listing of the directory: only
+     the files which came or went are parsed or dropped. ]]--
+
+local SUBDIR      = "pkgdest"
+local PERSIST_MIN = 64 -- files; smaller directories are listed again
+
+local indexes = {} -- dir => index, for this run
+
+local carch
+local function get_carch ()
+    carch = carch or util.getbasharray( "/etc/makepkg.conf", "CARCH" ) or ""
+    return carch
+end
+
+-- Returns the package name, version (with pkgrel) and arch in the
+-- name of a package file, or nil if it is not one.
+function parse_filename ( file )
+    local base = file:match( "^(.+)%.pkg%.tar%.?%w*$" )
+    if not base then return nil end
+    local name, pkgver, pkgrel, arch =
+        base:match( "^(.+)%-([^%-]+)%-([^%-]+)%-([^%-]+)$" )
+    if not name then return nil end
+    return name, pkgver .. "-" .. pkgrel, arch
+end
+
+-- An index has the package files of each package name, by file name,
+-- and the package name of every file, for telling what went away.
+local function new_index ()
+    return { count = 0; pkgs = {}; names = {} }
+end
+
+-- Brings index up to date with a listing of dir.
+local function refresh ( index, dir )
+    local seen, added, removed = {}, 0, 0
+    for file in lfs.dir( dir ) do
+        seen[ file ] = true
+        if not index.names[ file ] then
+            local name, version, arch = parse_filename( file )
+            if name then
+                index.pkgs[ name ] = index.pkgs[ name ] or {}
+                index.pkgs[ name ][ file ] = { version = version; arch = arch }
+                index.names[ file ] = name
+                added = added + 1
+            end
+        end
+    end
+
+    for file, name in pairs( index.names ) do
+        if not seen[ file ] then
+            index.pkgs[ name ][ file ] = nil
+            if not next( index.pkgs[ name ] ) then index.pkgs[ name ] = nil end
+            index.names[ file ] = nil
+            removed = removed + 1
+        end
+    end
+
+    index.count = index.count + added - removed
+    lprintf( "LOG_DEBUG", "pkgdest: %d files in %s, %d new, %d gone\n",
+             index.count, dir, added, removed )
+end
+
+local function get_index ( dir )
+    local mtime = lfs.attributes( dir, "modification" )
+    if not mtime then return nil end
+
+    local index = indexes[ dir ] or cache.load( SUBDIR, dir )
+    if not index or not index.names then index = new_index() end
+
+    -- Files added in the second we listed the directory would not
+    -- change its mtime, so an index listed then is checked again.
+    if index.mtime ~= mtime or index.listed <= mtime then
+        refresh( index, dir )
+        index.mtime, index.listed = mtime, os.time()
+        if index.count >= PERSIST_MIN then cache.store( SUBDIR, dir, index ) end
+    end
+    indexes[ dir ] = index
+    return index
+end
+
+--[[ Returns the path and version of the newest package file of pkgname
+     in dir built for our CARCH or for any arch, or nil if there is
+     none. ]]--
+function newest ( dir, pkgname )
+    local index = get_index( dir )
+    local best, bestfile
+    for file, entry in pairs( index and index.pkgs[ pkgname ] or {} ) do
+        if ( entry.arch == "any" or entry.arch == get_carch())
+            and ( not best
+                  or alpm.pkg_vercmp( entry.version, best.version ) > 0 ) then
+            best, bestfile = entry, file
+        end
+    end
+    if not best then return nil end
+    return dir .. "/" .. bestfile, best.version
+end
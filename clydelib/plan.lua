@@ -0,0 +1,108 @@
+module(..., package.seeall)
+---what -S --plan shows instead of building---
+local util     = require "clydelib.util"
+local history  = require "clydelib.history"
+local printf   = util.printf
+local C        = colorize
+
+--[[ The plan lists the repo packages which get installed first, then
+     the AUR packages wave by wave (see depgraph's waves()), each with
+     the AUR packages it waits on and what its past builds took (see
+     history). A wave's time is what it takes to build its packages
+     with BuildJobs at once, longest first, as the pipeline does; the
+     total adds up the waves, so it is on the safe side since the
+     pipeline overlaps them. ]]--
+
+local function format_time ( seconds )
+    seconds = math.floor( seconds + 0.5 )
+    if seconds < 60 then return string.format( "%ds", seconds ) end
+    if seconds < 3600 then
+        return string.format( "%dm %02ds", seconds / 60, seconds % 60 )
+    end
+    return string.format( "%dh %02dm", seconds / 3600, seconds / 60 % 60 )
+end
+
+local function format_size ( bytes )
+    return string.format( "%.2f MB", bytes / ( 1024 * 1024 ))
+end
+
+-- Returns how long building times takes with slots builds at a time,
+-- longest first.
+local function makespan ( times, slots )
+    table.sort( times, function ( a, b ) return a > b end )
+    local busy = {}
+    for i = 1, slots do busy[i] = 0 end
+    for i, time in ipairs( times ) do
+        table.sort( busy )
+        busy[1] = busy[1] + time
+    end
+    return math.max( unpack( busy ))
+end
+
+--[[ Prints the plan for graph (see depgraph). isaur( name ) tells the
+     AUR packages from repo packages. Returns nil and a cycle if the
+     packages cannot be ordered. ]]--
+function show ( graph, isaur )
+    local waves, cycle = graph:waves( function ( name )
+                                          return not isaur( name )
+                                      end )
+    if not waves then return nil, cycle end
+
+    printf( C.greb( "\n==>" ) .. C.bright( " Build plan\n" ))
+
+    local repopkgs = {}
+    for i, name in ipairs( graph.order ) do
+        if not isaur( name ) then table.insert( repopkgs, name ) end
+    end
+    if next( repopkgs ) then
+        util.list_display( string.format( "Repo packages (%d):", #repopkgs ),
+                           repopkgs )
+    end
+
+    local total, unknown, peakdisk = 0, 0, 0
+    for n, wave in ipairs( waves ) do
+        local times, lines = {}, {}
+        for i, name in ipairs( wave ) do
+            local line = string.format( "   %-30s ", name )
+            local est = history.estimate( name )
+            if est then
+                table.insert( times, est.time )
+                peakdisk = math.max( peakdisk, est.disk )
+                line = line .. string.format( "%8s %12s disk %12s",
+                                              format_time( est.time ),
+                                              format_size( est.disk ),
+                                              format_size( est.size ))
+            else
+                unknown = unknown + 1
+                line = line .. string.format( "%8s", "?" )
+            end
+
+            local needs = {}
+            for j, dep in ipairs( graph.nodes[ name ].deps ) do
+                if isaur( dep ) then table.insert( needs, dep ) end
+            end
+            if next( needs ) then
+                line = line .. C.italic( "  needs " .. table.concat( needs, " " ))
+            end
+            table.insert( lines, line )
+        end
+
+        local span = makespan( times, config.build_jobs )
+        total = total + span
+        printf( C.bright( "Wave %d" ) .. " (%d, %s)\n", n, #wave,
+                format_time( span ))
+        for i, line in ipairs( lines ) do print( line ) end
+    end
+
+    printf( C.bright( "\nEstimated build time: " ) .. "%s with %d build(s) at once\n",
+            format_time( total ), config.build_jobs )
+    if peakdisk > 0 then
+        printf( C.bright( "Largest build dir:    " ) .. "%s\n",
+                format_size( peakdisk ))
+    end
+    if unknown > 0 then
+        printf( "%d package(s) were never built here and are not counted.\n",
+                unknown )
+    end
+    return true
+end
@@ -5,6 +5,7 @@ local C = colorize
 local util = require "clydelib.util"
 local utilcore = require "clydelib.utilcore"
 local packages = require "clydelib.packages"
+local localrepo = require "clydelib.localrepo"
 local printf = util.printf
 local basename = util.basename
 local cleanup = util.cleanup
@@ -202,8 +203,9 @@ local function is_foreign(pkg)
 
     local match = false
 
+    -- What we built ourselves is foreign, even in our local repo.
     for i, db in ipairs(sync_dbs) do
-        local findpkg = db:db_get_pkg(pkgname)
+        local findpkg = not localrepo.is_local(db) and db:db_get_pkg(pkgname)
         if (findpkg) then
             match = true
             break
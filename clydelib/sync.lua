@@ -8,6 +8,14 @@ local util = require "clydelib.util"
 local utilcore = require "clydelib.utilcore"
 local packages = require "clydelib.packages"
 local aur = require "clydelib.aur"
+local async = require "clydelib.async"
+local aurindex = require "clydelib.aurindex"
+local cache = require "clydelib.cache"
+local depgraph = require "clydelib.depgraph"
+local pipeline = require "clydelib.pipeline"
+local plan = require "clydelib.plan"
+local localrepo = require "clydelib.localrepo"
+local pkgbuild = require "clydelib.pkgbuild"
 local upgrade = require "clydelib.upgrade"
 local callback = require "clydelib.callback"
 local ui = require "clydelib.ui"
@@ -349,65 +357,82 @@ local function sync_search_alpm ( targets, printcb )
                       size    = pkg:pkg_get_size();
                       groups  = pkg:pkg_get_groups() }
         end
+
+        -- Let AUR searches we started go on while we are busy.
+        async.poll()
     end
 
     return found_pkgs
 end
 
--- Returns an array of tables with info on packages who match the queries.
--- An AND search is performed so packages must match ALL the strings given.
-local function sync_search_aur ( targets, printcb )
-    if not targets or #targets == 0 then return {} end
-
-    -- Check all of our target strings first and remove invalid ones...
-    local targets = targets -- copy it first
-    local i = 1
-    while i <= #targets do
-        local target = targets[i]
+--[[ Starts searching the AUR for packages matching all of the targets, an
+     AND search. The requests are sent now and answered while we search
+     the repos. Returns a function which waits for the searches to finish
+     and returns an array of tables with info on the matching packages.
+
+     Each package is given to printcb as soon as it has matched every
+     target, in the order the AUR sends them, but not before the returned
+     function is called, so that AUR matches come after repo matches. ]]--
+local function start_search_aur ( targets, printcb )
+    -- Check all of our target strings first and leave out invalid ones...
+    local queries = {}
+    for i, target in ipairs( targets or {} ) do
         if #target < 2 then
             lprintf("LOG_WARNING",
                     "Query arg '%s' is too small to search AUR\n",
                     target)
-            table.remove( targets, i )
         else
-            i = i + 1
+            table.insert( queries, target )
         end
     end
+    if #queries == 0 then return function () return {} end end
 
-    -- In an AND query, matches are an intersection of all the result sets.
-    local matches_int = {}
-    for i, query in ipairs( targets ) do
-        local query_matches = aur.rpc_search( query )
-        if i == 1 then
-            matches_int = query_matches
-        else
-            -- Remove matches from the match intersection which are not also
-            -- matches in our current query.
-            for pkgname, unused in pairs( matches_int ) do
-                if not query_matches[ pkgname ] then
-                    matches_int[ pkgname ] = nil
-                end
+    -- The local index answers the whole query at once.
+    if aurindex.available() then
+        return function ()
+            local found = {}
+            for name, info in pairs( aurindex.search( queries )) do
+                info.dbname = "aur"
+                table.insert( found, info )
             end
+            table.sort( found, function ( a, b ) return a.name < b.name end )
+            for i, info in ipairs( found ) do printcb( info ) end
+            return found
         end
     end
 
-    local found = {}
-    for unused, pkginfo in pairs( matches_int ) do
-        table.insert( found, pkginfo )
-    end
-
-    local function by_name ( left, right ) return left.name < right.name end
+    -- A package is in the intersection once every query has returned it.
+    local found, held, holding = {}, {}, true
+    local nmatched = {}
+    local function query_match ( info )
+        local name = info.name
+        nmatched[ name ] = ( nmatched[ name ] or 0 ) + 1
+        if nmatched[ name ] < #queries then return end
 
-    table.sort( found, by_name )
-
-    for i, info in ipairs( found ) do
         -- XXX: Should we make a new clean copy of the table?
         info.dbname = "aur"
-        printcb( info )
+        table.insert( found, info )
+        if holding then table.insert( held, info )
+        else printcb( info ) end
+    end
+
+    -- Send all of the queries at once...
+    local searches = {}
+    for i, query in ipairs( queries ) do
+        searches[i] = aur.rpc_search_async( query, nil, query_match )
     end
+    async.poll()
 
+    return function ()
+        holding = false
+        for i, info in ipairs( held ) do printcb( info ) end
+        async.run()
 
-    return found
+        for i, search in ipairs( searches ) do
+            if not search.ok then error( search.results[1], 0 ) end
+        end
+        return found
+    end
 end
 
 -- Searches for the given "targets" in ALPM and AUR. Returns a list of
@@ -421,7 +446,13 @@ function sync_search ( targets, shownumbers )
         or mk_match_printer( shownumbers )
     local found_names = {}
 
-    -- First we search the ALPM repos...
+    -- The AUR takes longest to answer so we ask it first...
+    local finish_search_aur
+    if not config.op_s_search_repos_only then
+        finish_search_aur = start_search_aur( targets, match_printcb )
+    end
+
+    -- Then we search the ALPM repos while we wait...
     if not config.op_s_search_aur_only then
         local found_pkg_objs = sync_search_alpm( targets, match_printcb )
         for i, pkgobj in ipairs( found_pkg_objs ) do
@@ -429,10 +460,9 @@ function sync_search ( targets, shownumbers )
         end
     end
 
-    -- Next we search the AUR...
-    if not config.op_s_search_repos_only then
-        local found_aur_pkgs = sync_search_aur( targets, match_printcb )
-        for i, pkginfo in ipairs( found_aur_pkgs ) do
+    -- Then we print the AUR matches as they come in...
+    if finish_search_aur then
+        for i, pkginfo in ipairs( finish_search_aur()) do
             table.insert( found_names, pkginfo.name )
         end
     end
@@ -532,8 +562,52 @@ local function sync_info_alpm ( pkgname, reponame )
     return true
 end
 
-local function sync_info_aur ( pkgname )
-    if not aur.package_exists( pkgname ) then
+--[[ Returns a function which tells whether a target is on the AUR.
+     The first time it is called, every target which is not in our
+     repos (or which is prefixed with "aur/") is looked up with a single
+     batched multiinfo query. Targets added later are looked up in a
+     new batch when they are first asked about. ]]--
+local function aur_target_lookup ( targets )
+    local known = {}
+
+    local function lookup ( wanted )
+        local names, asked = {}, {}
+        local function ask ( name )
+            if asked[ name ] then return end
+            asked[ name ], known[ name ] = true, false
+            table.insert( names, name )
+        end
+
+        for i, target in ipairs( targets ) do
+            local reponame, pkgname = target:match( "^([^/]+)/(%S+)$" )
+            if reponame == "aur" then
+                if known[ pkgname ] == nil then ask( pkgname ) end
+            elseif not reponame and known[ target ] == nil
+                and not search_for_pkg( target ) then
+                ask( target )
+            end
+        end
+
+        -- The wanted package is asked for even when it is in our repos.
+        ask( wanted )
+
+        local success, result = pcall( aur.rpc_multiinfo, names )
+        if not success then
+            eprintf( "LOG_ERROR", result .. "\n" )
+            return
+        end
+
+        for name, info in pairs( result ) do known[ name ] = info end
+    end
+
+    return function ( pkgname )
+        if known[ pkgname ] == nil then lookup( pkgname ) end
+        return known[ pkgname ]
+    end
+end
+
+local function sync_info_aur ( pkgname, on_aur )
+    if not on_aur( pkgname ) then
         local err = string.format( "package '%s' was not found in the AUR\n",
                                    pkgname )
         return nil, err
@@ -543,29 +617,32 @@ local function sync_info_aur ( pkgname )
     return true
 end
 
-local function sync_info_target ( target )
+local function sync_info_target ( target, on_aur )
     -- If a repo name was given by using "reponame/pkgname" then
     -- this limits our search to one DB or the AUR.
     local reponame, pkgname = target:match( "^([^/]+)/(%S+)$" )
     if reponame and pkgname then
         local success, err
         if reponame == "aur" then
-            success, err = sync_info_aur( pkgname )
+            success, err = sync_info_aur( pkgname, on_aur )
         else
             success, err = sync_info_alpm( pkgname, reponame )
         end
         return success, err
     end
 
-    if sync_info_alpm( target ) or sync_info_aur( target ) then return true end
+    if sync_info_alpm( target ) or sync_info_aur( target, on_aur ) then
+        return true
+    end
     return nil, string.format( g("package '%s' was not found\n"), target )
 end
 
 local function sync_info ( targets )
     local error_occurred = false
+    local on_aur         = aur_target_lookup( targets )
 
     for i, target in ipairs( targets ) do
-        local success, err = sync_info_target( target )
+        local success, err = sync_info_target( target, on_aur )
         if not success then
             error_occurred = true -- note error but keep looping
             eprintf( "LOG_ERROR", err )
@@ -650,6 +727,7 @@ local function sync_aur_trans(targets)
     local data = {}
     local aurpkgs = {}
     local sync_dbs = alpm.option_get_syncdbs()
+    local on_aur = aur_target_lookup(targets)
     local function transcleanup()
         if (trans_release() == -1) then
             retval = 1
@@ -726,7 +804,7 @@ local function sync_aur_trans(targets)
 
                 if (not found) then
                     printf(C.blub("::")..C.bright(" %s group not found, searching AUR...\n"), targ)
-                    if aur.package_exists( targ ) then
+                    if on_aur( targ ) then
                         found = true
                         tblinsert( aurpkgs, targ )
                     end
@@ -843,99 +921,91 @@ local function sync_aur_trans(targets)
     end
 end
 
-local function updateprovided(tbl)
-    local localdb  = alpm.option_get_localdb()
-    local pkgcache = localdb:db_get_pkgcache()
-    for i, pkg in ipairs(pkgcache) do
-        tbl[pkg:pkg_get_name()] = pkg:pkg_get_version()
-        local provides = pkg:pkg_get_provides()
-        if (next(provides)) then
-            for i, prov in ipairs(provides) do
-                --TODO: Fix this so that it can handle versions properly
-                local p = prov:match("(.+)=") or prov
-                local v = prov:match("=(.+)") or nil
-                tbl[p] = v or true
+-- Indexes what the local and sync databases provide, for resolving
+-- dependencies with their versions.
+local function satisfier_index()
+    local index = alpm.satisfier_new()
+    index:add_db(alpm.option_get_localdb(), "local")
+    for i, db in ipairs(alpm.option_get_syncdbs()) do
+        if (localrepo.is_local(db)) then
+            for j, pkg in ipairs(db:db_get_pkgcache()) do
+                if (not localrepo.outdated(db, pkg:pkg_get_name())) then
+                    index:add_pkg(pkg, "sync")
+                end
             end
+        else
+            index:add_db(db, "sync")
         end
     end
+    return index
 end
 
-local function getdepends(target, provided)
-    local ret, ret2, ret3 = {}, {}, {}
-    local sync_dbs = alpm.option_get_syncdbs()
-    for i, db in ipairs(sync_dbs) do
-        local package = db:db_get_pkg(target)
-        if (package) then
-            local depends = package:pkg_get_depends()
-            for i, dep in ipairs(depends) do
-                tblinsert(ret, dep:dep_compute_string())
+-- Returns target from the first sync db which has it. Our local repo
+-- of AUR builds is skipped if withlocal is false, and for packages
+-- which must be built again.
+local function find_repo_pkg(target, withlocal)
+    for i, db in ipairs(alpm.option_get_syncdbs()) do
+        if (withlocal or not localrepo.is_local(db))
+            and not localrepo.outdated(db, target) then
+            local pkg = db:db_get_pkg(target)
+            if (pkg) then
+                return pkg
             end
         end
     end
-    local pkgbuild = aur.pkgbuild_text( target )
-    if not pkgbuild then
-        return ret, {}, {}
-    end
-    local tmp = os.tmpname()
-    local tmpfile = io.open(tmp, "w")
-    tmpfile:write(pkgbuild)
-    tmpfile:close()
-    local carch = getbasharray("/etc/makepkg.conf", "CARCH")
-    local depends = getpkgbuildarray(carch, tmp, "depends")
-    local makedepends = getpkgbuildarray(carch, tmp, "makedepends")
-    local optdepends = getpkgbuildarray(carch, tmp, "optdepends")
-    os.remove(tmp)
-    ret = strsplit(depends, " ") or {}
-    ret2 = strsplit(makedepends, " ") or {}
-    ret3 = strsplit(optdepends, " ") or {}
-    return ret, ret2, ret3
+    return nil
 end
 
-local function getalldeps(targs, needs, needsdeps, caninstall, provided)
-    local done = true
-    local depends, makedepends
-    for i, targ in ipairs(targs) do
-        if (not tblisin(needs, targ) and((not tblisin(needsdeps, targ) and not tblisin(caninstall, targ)) or not provided[targ])) then
-            tblinsert(needs, targ)
-        end
-        depends, makedepends = getdepends(targ, provided)
-        local bcaninstall = true
-        depends = tbljoin(depends, makedepends)
-        for i, dep in ipairs(depends) do
-        repeat
-            if dep == "" then break end
-            --TODO: Fix this so that it can handle versions properly
-            local dep = dep:match("(.+)<") or dep:match("(.+)>") or dep:match("(.+)=") or dep
-            depends[i] = dep
-            if (not provided[dep] or tblisin(targs, dep))then
-                if (not tblisin(needs, dep)) then
-                    tblinsert(needs, dep)
-                end
-                bcaninstall = false
-                if (not tblisin(needsdeps, targ) and not tblisin(caninstall, targ)) then
-                    done = false
-                end
-            end
-        until 1
-        end
-        if (bcaninstall) then
-            if (not tblisin(caninstall, targ)) then
-                tblinsert(caninstall, targ)
-            end
+-- Returns the depends, makedepends and optdepends of a package along
+-- with its version and provides, from the repos or else its PKGBUILD.
+local function getdepends(target)
+    local package = find_repo_pkg(target, true)
+    if (package) then
+        local depends = {}
+        for i, dep in ipairs(package:pkg_get_depends()) do
+            tblinsert(depends, dep:dep_compute_string())
+        end
+        return depends, {}, {}, package:pkg_get_version(),
+            package:pkg_get_provides()
+    end
+    local text = aur.pkgbuild_text( target )
+    if not text then
+        return {}, {}, {}
+    end
+    local info = pkgbuild.parse(text)
+    local version = pkgbuild.field(info, "pkgver")
+    if (version == "") then
+        version = nil
+    else
+        version = version.."-"..pkgbuild.field(info, "pkgrel")
+        if (pkgbuild.field(info, "epoch") ~= "") then
+            version = pkgbuild.field(info, "epoch")..":"..version
         end
     end
+    return info.depends, info.makedepends, info.optdepends, version,
+        info.provides
+end
 
-    local needsdepstbl = tbldiff(needs, caninstall)
-    for i, v in ipairs(needsdeps) do
-        i = nil
-    end
-    for i, v in ipairs(needsdepstbl) do
-        tblinsert(needsdeps, v)
-    end
+-- Resolves everything targets need into a dependency graph.
+local function dependency_graph(targets)
+    local graph = depgraph.new(satisfier_index(), function (name)
+        local depends, makedepends, optdepends, version, provides =
+            getdepends(name)
+        return tbljoin(depends, makedepends), version, provides
+    end)
+    graph:resolve(targets)
+    return graph
+end
 
-    if not done and next(depends) then
-        getalldeps(needs, needs, needsdeps, caninstall, provided)
+-- Tells the graph a package was installed, along with what it provides.
+-- Returns the packages which became ready to build.
+local function provide_installed(graph, pkgname)
+    local pkg = alpm.option_get_localdb():db_get_pkg(pkgname)
+    if (not pkg) then
+        return {}
     end
+
+    return graph:provide(pkgname, pkg:pkg_get_version(), pkg:pkg_get_provides())
 end
 
 local function removeflags(flag)
@@ -961,25 +1031,11 @@ local function removetblentry(tbl, entry)
 end
 
 local function pacmaninstallable(target)
-    local sync_dbs = alpm.option_get_syncdbs()
-    for i, db in ipairs(sync_dbs) do
-        local pkg = db:db_get_pkg(target)
-        if (pkg) then
-            return true
-        end
-    end
-    return false
+    return find_repo_pkg(target, true) ~= nil
 end
 
 function getpkgbuild(targets)
-    local provided = {}
-    local needs = {}
-    local caninstall = {}
-    local needsdeps = {}
-    local aurpkgs = {}
-
-    updateprovided(provided)
-    getalldeps(targets, needs, needsdeps, caninstall, provided)
+    local needs = dependency_graph(targets).order
 
     local names
     if (config.op_g_get_deps) then
@@ -988,28 +1044,38 @@ function getpkgbuild(targets)
         names = targets
     end
     
+    -- Download and extract all of the packages at once...
+    local downloads = {}
     for i, pkgname in ipairs(names) do
-        if (not pacmaninstallable(pkgname)) then
-            aur.download_extract(pkgname, ".")
+        if (not find_repo_pkg(pkgname, false)) then
+            tblinsert(downloads, aur.download_extract_async(pkgname, "."))
+        end
+    end
+    async.run()
+
+    for i, download in ipairs(downloads) do
+        if (not download.ok) then
+            error(download.results[1], 0)
         end
     end
 end
 
 local function aur_install(targets)
-    local provided = {}
-    local needs = {}
-    local caninstall = {}
-    local needsdeps = {}
-    updateprovided(provided)
+    local graph = dependency_graph(targets)
+    local needs = graph.order
 
-    getalldeps(targets, needs, needsdeps, caninstall, provided)
+    local buildorder, cycle = graph:toposort()
+    if (not buildorder) then
+        eprintf("LOG_ERROR", g("dependency cycle detected: %s\n"),
+                tblconcat(cycle, " -> "))
+        cleanup(1)
+    end
 
     tflags = {}
     for flag, status in pairs( config.flags ) do
         if status then tflags[flag] = true end
     end
 
-    local installed = 0
     local pacmanpkgs = {}
     local pacmanexplicit = {}
     local pacmandeps = {}
@@ -1019,12 +1085,12 @@ local function aur_install(targets)
         if (pacmaninstallable(pkg)) then
             tblinsert(pacmanpkgs, pkg)
         else
-            tblinsert(aurpkgs, pkg)
+            aurpkgs[pkg] = true
         end
     end
 
     for i, pkg in ipairs(pacmanpkgs) do
-        if (tblisin(targets, pkg) and not tflags["alldeps"]
+        if (graph.targets[pkg] and not tflags["alldeps"]
             or (tflags["allexplicit"] and not tflags["alldeps"])) then
             tblinsert(pacmanexplicit, pkg)
         else
@@ -1039,49 +1105,93 @@ local function aur_install(targets)
     config.flags["alldeps"] = false
     config.noconfirm = noconfirm
 
-    local origdir = lfs.currentdir()
+    for i, pkg in ipairs(pacmanpkgs) do
+        provide_installed(graph, pkg)
+    end
 
-    local installedtbl = {}
-    local needscount = #needs - #pacmanpkgs
-    while (#installedtbl < needscount ) do
-        repeat
-        updateprovided(provided)
-        caninstall, needs, needsdeps = {}, {}, {}
-        getalldeps(targets, needs, needsdeps, caninstall, provided)
+    local aurorder = {}
+    for i, pkg in ipairs(buildorder) do
+        if (aurpkgs[pkg]) then
+            tblinsert(aurorder, pkg)
+        end
+    end
 
-        for i, pkg in ipairs(aurpkgs) do
-            if (tblisin(caninstall, pkg)
-                and not tblisin(installedtbl, pkg)) then
+    -- Fetch every AUR tarball at once and customize them before any
+    -- build starts, so that questions are not lost in build output.
+    local downloads = {}
+    for i, pkg in ipairs(aurorder) do
+        downloads[pkg] = aur.download_extract_async(pkg, aur.make_builddir(pkg))
+    end
+    async.run()
 
-                local oldflag = config.flags.alldeps
-                local newflag = not tflags.alldeps
-                    and (tblisin(targets, pkg) or tflags.allexplicit)
+    local dirs = {}
+    for i, pkg in ipairs(aurorder) do
+        local download = downloads[pkg]
+        if (not download.ok) then
+            error(download.results[1], 0)
+        end
+        local pkgdir = download.results[1]
+        dirs[pkg] = pkgdir
+
+        -- Don't let root hog our new package files...
+        if utilcore.geteuid() == 0 then
+            aur.chown_builduser(pkgdir, '-R')
+        end
 
-                config.flags.alldeps = newflag
+        if not config.noconfirm then
+            aur.customizepkg(pkg, pkgdir)
+        end
+    end
 
-                local dldir  = aur.make_builddir(pkg)
-                local pkgpath, pkgdir = aur.download_extract(pkg, dldir)
+    -- Each wave of built packages is installed in one transaction,
+    -- with the flags we were given. Like pacman, upgrades keep their
+    -- install reason and new packages are explicit, so the ones which
+    -- are only dependencies are marked as such afterwards, in a
+    -- transaction of their own for the database lock, as pacman -D does.
+    config.flags.alldeps = tflags.alldeps
+    local built = {}
+    pipeline.run(graph, aurorder, dirs, function (names)
+        local localdb = alpm.option_get_localdb()
+        local asdeps = {}
+        for i, pkg in ipairs(names) do
+            if (not graph.targets[pkg] and not tflags.allexplicit
+                and not tflags.alldeps and not localdb:db_get_pkg(pkg)) then
+                asdeps[pkg] = true
+            end
+        end
 
-                -- Don't let root hog our new package files...
-                if utilcore.geteuid() == 0 then
-                    aur.chown_builduser(pkgpath)
-                    aur.chown_builduser(pkgdir, '-R')
-                end
+        local pkgfiles = aur.installpkgs(names)
 
-                if not config.noconfirm then
-                    aur.customizepkg(pkg, pkgdir)
+        if (next(asdeps) and trans_init({}) == 0) then
+            for i, pkg in ipairs(names) do
+                if (asdeps[pkg]
+                    and localdb:db_set_pkgreason(pkg, "P_R_DEPEND") == -1) then
+                    eprintf("LOG_WARNING", g("could not set install reason for %s (%s)\n"),
+                            pkg, alpm.strerrorlast())
                 end
+            end
+            trans_release()
+        end
 
-                aur.makepkg(pkgdir)
-                aur.installpkg(pkg)
+        local ok, err = localrepo.add(names, pkgfiles)
+        if (not ok) then
+            eprintf("LOG_WARNING", g("could not add %s to %s: %s\n"),
+                    tblconcat(names, " "), localrepo.NAME, err)
+        end
 
-                installed = installed + 1
-                tblinsert(installedtbl, pkg)
+        for i, pkg in ipairs(names) do
+            built[pkg] = true
+            provide_installed(graph, pkg)
+        end
+    end)
 
-                config.flags.alldeps = oldflag
-            end
+    -- Whatever is left waits on something which failed to install.
+    for i, pkg in ipairs(aurorder) do
+        if (not built[pkg]) then
+            eprintf("LOG_ERROR", g("cannot build %s, missing dependencies: %s\n"),
+                    pkg, tblconcat(graph:missing(pkg), " "))
+            cleanup(1)
         end
-        until 1
     end
 end
 
@@ -1098,40 +1208,80 @@ local function get_ignore_pkgs()
     return ignore_pkgs
 end
 
+--[[ The AUR version and LastModified time of each foreign package found
+     on the AUR are kept in the "upgrade" cache subdirectory from one
+     upgrade check to the next. The AUR RPC cannot tell us what changed
+     since then but the AUR index (AurIndex) has the LastModified time of
+     every package, so with it we only ask the AUR about packages which
+     changed, which we have not seen before or which look suspect. ]]--
+
+local function load_aur_state ()
+    local entry = cache.load( "upgrade", "foreign" )
+    return entry and entry.pkgs or {}
+end
+
+-- Remembers what the AUR told us about the packages we asked about.
+-- Those which were asked about but not found are forgotten.
+local function save_aur_state ( state, asked, aurinfo )
+    for i, name in ipairs( asked ) do
+        local info = aurinfo[ name ]
+        state[ name ] = info and { version = info.version,
+                                   lastmod = tonumber( info.lastmodified ) }
+    end
+    cache.store( "upgrade", "foreign", { time = os.time(), pkgs = state } )
+end
+
+-- Splits foreign packages into those whose AUR info we know is still
+-- the same, returned as a table of their info, and the list of names
+-- we have to ask the AUR about.
+local function aur_unchanged ( foreign_pkgs, state )
+    local names = {}
+    for i, foreigner in ipairs( foreign_pkgs ) do
+        table.insert( names, foreigner.name )
+    end
+    if not aurindex.available() then return {}, names end
+
+    local indexed = aurindex.lookup_names( names )
+    local known, ask = {}, {}
+    for i, foreigner in ipairs( foreign_pkgs ) do
+        local name = foreigner.name
+        local seen, current = state[ name ], indexed[ name ]
+
+        -- Installing a newer version than the AUR had is suspect, our
+        -- index could be older than the package.
+        if seen and current and seen.lastmod
+            and seen.lastmod == current.lastmod
+            and seen.version == current.version
+            and alpm.pkg_vercmp( foreigner.version, seen.version ) <= 0 then
+            known[ name ] = { name = name; version = seen.version;
+                              lastmodified = seen.lastmod }
+        else
+            -- Packages in neither are asked about too: they may have been
+            -- uploaded after the index was fetched, or a lookup of them
+            -- failed the last time.
+            table.insert( ask, name )
+        end
+    end
+
+    return known, ask
+end
+
 local function find_installed_aur ()
     -- Gather a list of packages which aren't available from our repos...
-    local foreign_count, foreign_pkgs = 0, {}
+    local foreign_pkgs = {}
     local is_ignorepkg = get_ignore_pkgs()
 
     local localdb = alpm.option_get_localdb()
     for i, pkg in ipairs( localdb:db_get_pkgcache()) do
         local name = pkg:pkg_get_name()
 
-        if not is_ignorepkg[name] and not pacmaninstallable(name) then
+        if not is_ignorepkg[name] and not find_repo_pkg( name, false ) then
             local foreigner = { name = name; version = pkg:pkg_get_version() }
             table.insert( foreign_pkgs, foreigner )
-            foreign_count = foreign_count + 1
         end
     end
 
-    -- If the version on AUR is > our installed version get ready
-    -- to update the package from AUR...
-
-    local function aur_version ( pkgname )
-        local success, result = pcall( aur.rpc_info, pkgname )
-
-        if not success then
-            print() -- Print newline, skip the progress bar.
-            eprintf( "LOG_ERROR", result .. "\n" )
-            return nil
-        end
-
-        if result then return result.version
-        else return nil
-        end
-    end
-
-    -- Loop through the packages in alphabetical order...
+    -- Keep the packages in alphabetical order...
     table.sort( foreign_pkgs,
                 function ( left, right )
                     return left.name < right.name
@@ -1139,29 +1289,52 @@ local function find_installed_aur ()
 
     print( C.blub("::") .. C.bright(" Identifying AUR packages..."))
 
-    local aurpkgs = {}
-    for i, foreigner in ipairs( foreign_pkgs ) do
-        local name, version = foreigner.name, foreigner.version
-
-        -- Display the progress bar with package name...
-        local dispname = name
-        if #dispname > 22 then
-            dispname = string.sub( dispname, 1, 19 )
-            dispname = dispname .. "..."
-        end
-
+    -- Display the progress bar as each batch of names is answered...
+    local function show_progress ( done, total )
         local message = string.format( " %-23s%3.0f/%3.0f",
-                                       dispname, i, foreign_count )
+                                       "AUR packages", done, total )
 
         io.write( message )
-        callback.fill_progress( math.floor( i*100/foreign_count ),
-                                math.ceil( i*100/foreign_count ),
+        callback.fill_progress( math.floor( done*100/total ),
+                                math.ceil( done*100/total ),
                                 util.getcols() - #message )
+    end
 
-        -- If a newer version is on the AUR, then add it to our list
-        local aurver = aur_version( name )
-        if aurver and alpm.pkg_vercmp( aurver, version ) > 0 then
-            table.insert( aurpkgs, name )
+    -- Look up the foreign packages which may have changed with batched
+    -- multiinfo queries instead of one query per package...
+    local state = load_aur_state()
+    local aurinfo, names = aur_unchanged( foreign_pkgs, state )
+    local nknown = #foreign_pkgs - #names
+    lprintf( "LOG_DEBUG", "asking AUR about %d of %d foreign packages\n",
+             #names, #foreign_pkgs )
+
+    local function count_known ( done, total )
+        show_progress( nknown + done, nknown + total )
+    end
+
+    local success, fetched = pcall( aur.rpc_multiinfo, names, count_known )
+    if not success then
+        print() -- Print newline, skip the progress bar.
+        eprintf( "LOG_ERROR", fetched .. "\n" )
+    else
+        if #names == 0 and nknown > 0 then count_known( 0, 0 ) end
+        for name, info in pairs( fetched ) do aurinfo[ name ] = info end
+
+        -- Offline, what was not cached is missing but not gone.
+        if #names > 0 and not config.offline then
+            save_aur_state( state, names, fetched )
+        end
+    end
+
+    -- If the version on AUR is > our installed version get ready
+    -- to update the package from AUR...
+    local aurpkgs = {}
+    for i, foreigner in ipairs( foreign_pkgs ) do
+        local info = aurinfo[ foreigner.name ]
+        if info and alpm.pkg_vercmp( info.version, foreigner.version ) > 0
+        then
+            table.insert( aurpkgs, foreigner.name )
+            localrepo.outdate( foreigner.name )
         end
     end
 
@@ -1178,6 +1351,7 @@ local function sync_trans(targets)
     local data = {}
     local aurpkgs = {}
     local sync_dbs = alpm.option_get_syncdbs()
+    local on_aur = aur_target_lookup(targets)
     local function transcleanup()
         if (trans_release() == -1) then
             retval = 1
@@ -1259,7 +1433,7 @@ local function sync_trans(targets)
 
                 if (not found) then
                     printf(C.blub("::")..C.bright(" %s group not found, searching AUR...\n"), targ)
-                    if aur.package_exists( targ ) then
+                    if on_aur( targ ) then
                         found = true
                         tblinsert( aurpkgs, targ )
                     end
@@ -1317,17 +1491,15 @@ local function sync_trans(targets)
         return transcleanup()
     end
 
-    local needs, provided, needsdeps, caninstall, possibleaur =
-        {}, {}, {}, {}, {}
-
+    local possibleaur = {}
     for i, pkg in ipairs(targets) do
         if (not pacmaninstallable(pkg)) then
             tblinsert(possibleaur, pkg)
         end
     end
 
-    updateprovided(provided)
-    getalldeps(possibleaur, needs, needsdeps, caninstall, provided)
+    local graph = dependency_graph(possibleaur)
+    local needs = graph.order
 
     local needsdupe = tblstrdup(needs)
 
@@ -1368,6 +1540,20 @@ local function sync_trans(targets)
 
     printf("\n")
 
+    if (config.op_s_plan) then
+        if (next(aurpkgs)) then
+            local ok, cycle = plan.show(graph, function (name)
+                return not pacmaninstallable(name)
+            end)
+            if (not ok) then
+                eprintf("LOG_ERROR", g("dependency cycle detected: %s\n"),
+                        tblconcat(cycle, " -> "))
+                retval = 1
+            end
+        end
+        return transcleanup()
+    end
+
     local confirm
     if (config.op_s_downloadonly) then
         confirm = yesno(C.yelb("==>")..C.bright(" Proceed with download?"))
@@ -1451,6 +1637,9 @@ local function clyde_sync(targets)
         if (sync_synctree(config.op_s_sync, sync_dbs) ~= 1) then
           return 1
         end
+        if (not config.op_s_search_repos_only and not config.offline) then
+            aurindex.refresh(config.op_s_sync >= 2)
+        end
     end
 
     if (config.op_s_search) then
@@ -1494,7 +1683,8 @@ local function clyde_sync(targets)
 
     local targs = tblstrdup(targets)
 
-    if (not config.flags["downloadonly"] and (not config.op_s_printuris)) then
+    if (not config.flags["downloadonly"] and not config.op_s_printuris
+        and not config.op_s_plan) then
         local packages = syncfirst()
         if (next(packages)) then
             local tmp = tbldiff(targets, packages)
@@ -2,6 +2,7 @@ module(..., package.seeall)
 local alpm = require "lualpm"
 local lfs = require "lfs"
 local utilcore = require "clydelib.utilcore"
+local bashvars = require "clydelib.bashvars"
 local signal = require "clydelib.signal"
 local C = colorize
 local g = utilcore.gettext
@@ -300,7 +301,8 @@ function needs_root()
     if (config.op == "PM_OP_UPGRADE" or config.op == "PM_OP_REMOVE" or
         (config.op == "PM_OP_SYNC" and (config.op_s_clean > 0 or config.op_s_sync > 0 or
             (config.group == 0 and not config.op_s_info and not config.op_q_list
-            and not config.op_s_search and not config.op_s_printuris)))) then
+            and not config.op_s_search and not config.op_s_printuris
+            and not config.op_s_plan)))) then
         return true
     else
         return false
@@ -604,7 +606,29 @@ function mkversion(s)
         return t;
 end
 
+-- Returns the variables a bash file sets, as name => list of values,
+-- or nil if only bash can tell. presets are set before reading it.
+local function readbashvars(file, presets)
+    local fd = io.open(file, "r")
+    if (not fd) then
+        return {}
+    end
+    local text = fd:read("*a")
+    fd:close()
+
+    local vars, err = bashvars.parse(text, presets)
+    if (not vars) then
+        lprintf("LOG_DEBUG", "%s: asking bash, %s\n", file, err)
+    end
+    return vars
+end
+
 function getbasharray(file, str)
+    local vars = readbashvars(file)
+    if (vars) then
+        return table.concat(vars[str] or {}, " ")
+    end
+
     local fd = io.popen(string.format([[
         /bin/bash -c '. %s &> /dev/null
         echo "${%s[@]}"'
@@ -615,6 +639,11 @@ function getbasharray(file, str)
 end
 
 function getpkgbuildarray(carch, pkgbuild, str)
+    local vars = readbashvars(pkgbuild, { CARCH = carch })
+    if (vars) then
+        return table.concat(vars[str] or {}, " ")
+    end
+
     local fd =  io.popen(string.format([[
         /bin/bash -c 'CARCH=%s
         . %s &> /dev/null
@@ -626,6 +655,11 @@ function getpkgbuildarray(carch, pkgbuild, str)
 end
 
 function getpkgbuildarraylinebreak(carch, pkgbuild, str)
+    local vars = readbashvars(pkgbuild, { CARCH = carch })
+    if (vars) then
+        return tblstrdup(vars[str] or {})
+    end
+
     local fd = io.popen(string.format([[
     /bin/bash -c 'CARCH=%s
     . %s &> /dev/null
@@ -641,6 +675,11 @@ function getpkgbuildarraylinebreak(carch, pkgbuild, str)
 end
 
 function getbasharrayuser(file, str, user)
+    local vars = readbashvars(file, { USER = user })
+    if (vars) then
+        return table.concat(vars[str] or {}, " ")
+    end
+
     local fd =  io.popen(string.format([[
         /bin/bash -c 'export USER=%s
         . %s &> /dev/null
@@ -1,4 +1,4 @@
-/* gcc -W -Wall -pedantic -std=c99 -D_GNU_SOURCE `pkg-config --cflags lua` -fPIC -shared -o utilcore.so utilcore.c */
+/* gcc -W -Wall -pedantic -std=c99 -D_GNU_SOURCE `pkg-config --cflags lua` -fPIC -shared -o utilcore.so utilcore.c -lcrypto */
 #include <lua.h>
 #include <lualib.h>
 #include <lauxlib.h>
@@ -13,7 +13,12 @@
 #include <sys/time.h>
 #include <sys/utsname.h>
 #include <sys/prctl.h> /* for setprocname */
+#include <sys/wait.h>
 #include <pwd.h>
+#include <grp.h>
+#include <poll.h>
+
+#include <openssl/evp.h>
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -25,6 +30,7 @@
 #include <dirent.h>
 #include <unistd.h> /* isatty, getuid */
 #include <limits.h>
+#include <stdint.h>
 #include <wchar.h>
 #include <termios.h>
 
@@ -239,6 +245,7 @@ static int clyde_mkdir ( lua_State *L )
     oldmask = umask( 0 );
 
     if ( mkdir( path, mode ) != 0 ) {
+        umask( oldmask );
         lua_pushstring( L, strerror( errno ));
         lua_error( L );
     }
@@ -274,6 +281,100 @@ static int clyde_arch(lua_State *L)
     return 1;
 }
 
+/* Returns the 64-bit FNV-1a hash of a string, as 16 hex digits. This
+   is for telling contents apart in caches, not for security. */
+static int clyde_strhash ( lua_State *L )
+{
+    size_t len, i;
+    const unsigned char *str;
+    uint64_t hash = 14695981039346656037ULL;
+    char hex[17];
+
+    str = (const unsigned char *) luaL_checklstring( L, 1, &len );
+    for ( i = 0 ; i < len ; ++i ) {
+        hash ^= str[i];
+        hash *= 1099511628211ULL;
+    }
+
+    snprintf( hex, sizeof hex, "%016llx", (unsigned long long) hash );
+    lua_pushlstring( L, hex, 16 );
+    return 1;
+}
+
+/* Finishes the SHA-256 digest in ctx and pushes it as 64 hex digits. */
+static void push_sha256 ( lua_State *L, EVP_MD_CTX *ctx )
+{
+    unsigned char digest[ EVP_MAX_MD_SIZE ];
+    unsigned int len, i;
+    char hex[ 2 * EVP_MAX_MD_SIZE + 1 ];
+
+    EVP_DigestFinal_ex( ctx, digest, &len );
+    EVP_MD_CTX_free( ctx );
+    for ( i = 0 ; i < len ; ++i ) {
+        snprintf( hex + 2 * i, 3, "%02x", digest[i] );
+    }
+    lua_pushlstring( L, hex, 2 * len );
+}
+
+static EVP_MD_CTX *new_sha256 ( lua_State *L )
+{
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+    if ( ctx == NULL || !EVP_DigestInit_ex( ctx, EVP_sha256(), NULL )) {
+        EVP_MD_CTX_free( ctx );
+        luaL_error( L, "sha256: cannot initialize the digest" );
+    }
+    return ctx;
+}
+
+/* Returns the SHA-256 digest of a string, as 64 hex digits. Unlike
+   strhash this is safe to trust for what we install. */
+static int clyde_sha256 ( lua_State *L )
+{
+    size_t len;
+    const char *str = luaL_checklstring( L, 1, &len );
+    EVP_MD_CTX *ctx = new_sha256( L );
+
+    EVP_DigestUpdate( ctx, str, len );
+    push_sha256( L, ctx );
+    return 1;
+}
+
+/* Returns the SHA-256 digest of the file at path, as 64 hex digits, or
+   nil and a message if it cannot be read. */
+static int clyde_sha256file ( lua_State *L )
+{
+    const char *path = luaL_checkstring( L, 1 );
+    char buf[ 65536 ];
+    EVP_MD_CTX *ctx;
+    ssize_t len;
+    int fd;
+
+    fd = open( path, O_RDONLY );
+    if ( fd == -1 ) {
+        lua_pushnil( L );
+        lua_pushfstring( L, "%s: %s", path, strerror( errno ));
+        return 2;
+    }
+
+    ctx = new_sha256( L );
+    while (( len = read( fd, buf, sizeof buf )) != 0 ) {
+        if ( len == -1 && errno == EINTR ) continue;
+        if ( len == -1 ) {
+            int err = errno;
+            EVP_MD_CTX_free( ctx );
+            close( fd );
+            lua_pushnil( L );
+            lua_pushfstring( L, "%s: %s", path, strerror( err ));
+            return 2;
+        }
+        EVP_DigestUpdate( ctx, buf, len );
+    }
+    close( fd );
+
+    push_sha256( L, ctx );
+    return 1;
+}
+
 static void throw_errno ( lua_State *L, const char * funcname )
 {
     lua_pushfstring( L, "%s: %s", funcname, strerror( errno ));
@@ -296,6 +397,403 @@ static int clyde_setprocname ( lua_State *L )
     return 0;
 }
 
+/* Returns how many processors are online. */
+static int clyde_nprocs ( lua_State *L )
+{
+    long n = sysconf( _SC_NPROCESSORS_ONLN );
+
+    lua_pushinteger( L, n > 0 ? n : 1 );
+    return 1;
+}
+
+/* spawn( argv [, opts] ) runs argv[1], searched for in PATH, with the
+   arguments in argv and returns its pid without waiting for it. opts
+   may have dir (to run in), umask (like umask's argument), log (a file
+   which gets the child's stdout and stderr) and env (a table of
+   variables to set in the child's environment). */
+static int clyde_spawn ( lua_State *L )
+{
+    const char **argv, **envnames, **envvalues;
+    const char *dir = NULL, *log = NULL;
+    mode_t mask = 0;
+    int hasmask = 0, logfd = -1;
+    size_t argc, envc = 0, i;
+    pid_t pid;
+
+    luaL_checktype( L, 1, LUA_TTABLE );
+    argc = lua_objlen( L, 1 );
+    if ( argc == 0 ) { return luaL_argerror( L, 1, "empty argv" ); }
+    if ( lua_isnoneornil( L, 2 )) {
+        lua_settop( L, 1 );
+        lua_newtable( L );
+    }
+    luaL_checktype( L, 2, LUA_TTABLE );
+    lua_settop( L, 2 );
+
+    /* Everything the child needs is gathered before forking. The
+       strings stay referenced by the tables on our stack: numbers are
+       converted to strings which are kept in the table at index 7. */
+    lua_getfield( L, 2, "env" );
+    if ( lua_istable( L, 3 )) {
+        lua_pushnil( L );
+        while ( lua_next( L, 3 )) { ++envc; lua_pop( L, 1 ); }
+    }
+
+    argv      = lua_newuserdata( L, sizeof( char * ) * ( argc + 1 ));
+    envnames  = lua_newuserdata( L, sizeof( char * ) * ( envc + 1 ));
+    envvalues = lua_newuserdata( L, sizeof( char * ) * ( envc + 1 ));
+    lua_createtable( L, argc + envc, 0 );
+
+    for ( i = 0 ; i < argc ; ++i ) {
+        lua_rawgeti( L, 1, i + 1 );
+        argv[i] = lua_tostring( L, -1 );
+        if ( argv[i] == NULL ) {
+            return luaL_argerror( L, 1, "argv must only have strings" );
+        }
+        lua_rawseti( L, 7, i + 1 );
+    }
+    argv[argc] = NULL;
+
+    if ( envc > 0 ) {
+        i = 0;
+        lua_pushnil( L );
+        while ( lua_next( L, 3 )) {
+            /* Converting the key would confuse lua_next(). */
+            if ( lua_type( L, -2 ) != LUA_TSTRING ) {
+                return luaL_argerror( L, 2, "env must map strings to strings" );
+            }
+            envnames[i]  = lua_tostring( L, -2 );
+            envvalues[i] = lua_tostring( L, -1 );
+            if ( envvalues[i] == NULL ) {
+                return luaL_argerror( L, 2, "env must map strings to strings" );
+            }
+            lua_rawseti( L, 7, argc + i + 1 );
+            ++i;
+        }
+    }
+
+    lua_getfield( L, 2, "dir" );
+    dir = lua_tostring( L, -1 );
+    lua_getfield( L, 2, "log" );
+    log = lua_tostring( L, -1 );
+    lua_getfield( L, 2, "umask" );
+    if ( !lua_isnil( L, -1 )) {
+        mask    = lua_tomode( L, -1 );
+        hasmask = 1;
+    }
+
+    if ( log ) {
+        logfd = open( log, O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+        CHECK_ERR( "open", logfd );
+    }
+
+    pid = fork();
+    if ( pid == -1 ) {
+        if ( logfd != -1 ) close( logfd );
+        throw_errno( L, "fork" );
+    }
+
+    if ( pid == 0 ) {
+        for ( i = 0 ; i < envc ; ++i ) {
+            setenv( envnames[i], envvalues[i], 1 );
+        }
+        if ( hasmask ) umask( mask );
+        if ( logfd != -1 ) {
+            dup2( logfd, 1 );
+            dup2( logfd, 2 );
+            close( logfd );
+        }
+        if ( dir && chdir( dir ) == -1 ) {
+            fprintf( stderr, "chdir %s: %s\n", dir, strerror( errno ));
+            _exit( 127 );
+        }
+        execvp( argv[0], (char * const *) argv );
+        fprintf( stderr, "%s: %s\n", argv[0], strerror( errno ));
+        _exit( 127 );
+    }
+
+    if ( logfd != -1 ) close( logfd );
+    lua_pushinteger( L, pid );
+    return 1;
+}
+
+/* waitpid( [pid [, nohang]] ) waits for the child pid, or any child,
+   to exit and returns its pid and exit status; a child killed by a
+   signal gets 128 plus the signal's number, like in the shell. With
+   nohang, returns nothing if no child has exited yet. Returns nil and
+   a message if there is no such child. */
+static int clyde_waitpid ( lua_State *L )
+{
+    pid_t pid   = luaL_optinteger( L, 1, -1 );
+    int   flags = lua_toboolean( L, 2 ) ? WNOHANG : 0;
+    int   status;
+    pid_t ret;
+
+    /* Keep pid for retrying, or an EINTR would make us wait for any. */
+    do {
+        ret = waitpid( pid, &status, flags );
+    } while ( ret == -1 && errno == EINTR );
+
+    if ( ret == -1 ) {
+        lua_pushnil( L );
+        lua_pushstring( L, strerror( errno ));
+        return 2;
+    }
+    if ( ret == 0 ) { return 0; }
+
+    lua_pushinteger( L, ret );
+    if ( WIFEXITED( status )) {
+        lua_pushinteger( L, WEXITSTATUS( status ));
+    }
+    else {
+        lua_pushinteger( L, 128 + WTERMSIG( status ));
+    }
+    return 2;
+}
+
+/* pipe() returns the read and write ends of a new pipe, as fds which
+   the programs spawn() runs do not inherit. */
+static int clyde_pipe ( lua_State *L )
+{
+    int fds[2];
+
+    CHECK_ERR( "pipe", pipe( fds ));
+    fcntl( fds[0], F_SETFD, FD_CLOEXEC );
+    fcntl( fds[1], F_SETFD, FD_CLOEXEC );
+    lua_pushinteger( L, fds[0] );
+    lua_pushinteger( L, fds[1] );
+    return 2;
+}
+
+/* fork() returns the child's pid in the parent and 0 in the child. */
+static int clyde_fork ( lua_State *L )
+{
+    pid_t pid;
+
+    fflush( NULL );
+    pid = fork();
+    CHECK_ERR( "fork", pid );
+    lua_pushinteger( L, pid );
+    return 1;
+}
+
+/* exit( [status] ) ends a child made by fork() at once, without the
+   parent's atexit handlers or buffered output. */
+static int clyde_exit ( lua_State *L )
+{
+    fflush( NULL );
+    _exit( luaL_optinteger( L, 1, 0 ));
+    return 0;
+}
+
+/* read( fd ) returns what can be read from fd at once, up to a block,
+   or "" at the end of the file. */
+static int clyde_read ( lua_State *L )
+{
+    char buf[4096];
+    int fd = luaL_checkinteger( L, 1 );
+    ssize_t n;
+
+    do {
+        n = read( fd, buf, sizeof buf );
+    } while ( n == -1 && errno == EINTR );
+    CHECK_ERR( "read", n );
+
+    lua_pushlstring( L, buf, n );
+    return 1;
+}
+
+/* write( fd, data ) writes all of data to fd. */
+static int clyde_write ( lua_State *L )
+{
+    int fd = luaL_checkinteger( L, 1 );
+    size_t len;
+    const char *data = luaL_checklstring( L, 2, &len );
+    ssize_t n;
+
+    while ( len > 0 ) {
+        n = write( fd, data, len );
+        if ( n == -1 && errno == EINTR ) continue;
+        CHECK_ERR( "write", n );
+        data += n;
+        len  -= n;
+    }
+    return 0;
+}
+
+static int clyde_close ( lua_State *L )
+{
+    CHECK_ERR( "close", close( luaL_checkinteger( L, 1 )));
+    return 0;
+}
+
+#define POLL_MAX 16
+
+/* poll( fds [, timeout] ) waits for any of the list fds to be readable,
+   or at its end, for at most timeout seconds. Without a timeout it
+   waits as long as it takes. Returns a table with the fds which are
+   ready as keys; it is empty after a timeout or a signal. */
+static int clyde_poll ( lua_State *L )
+{
+    struct pollfd pfds[ POLL_MAX ];
+    double timeout = luaL_optnumber( L, 2, -1 );
+    int count, i, n;
+
+    luaL_checktype( L, 1, LUA_TTABLE );
+    count = lua_objlen( L, 1 );
+    luaL_argcheck( L, count <= POLL_MAX, 1, "too many fds" );
+    for ( i = 0 ; i < count ; ++i ) {
+        lua_rawgeti( L, 1, i + 1 );
+        pfds[i].fd      = luaL_checkinteger( L, -1 );
+        pfds[i].events  = POLLIN;
+        pfds[i].revents = 0;
+        lua_pop( L, 1 );
+    }
+
+    n = poll( pfds, count, timeout < 0 ? -1 : (int) ( timeout * 1000 ));
+    if ( n == -1 && errno == EINTR ) n = 0;
+    CHECK_ERR( "poll", n );
+
+    lua_newtable( L );
+    for ( i = 0 ; i < count && n > 0 ; ++i ) {
+        if ( pfds[i].revents == 0 ) continue;
+        lua_pushboolean( L, 1 );
+        lua_rawseti( L, -2, pfds[i].fd );
+    }
+    return 1;
+}
+
+/* The pipe SIGCHLD is reported to, see sigchldfd(). */
+static int sigchld_pipe[2] = { -1, -1 };
+
+static void sigchld_handler ( int sig )
+{
+    int olderrno = errno;
+    ssize_t ignored;
+
+    (void) sig;
+    /* If the pipe is full there is a wakeup waiting already. */
+    ignored = write( sigchld_pipe[1], "", 1 );
+    (void) ignored;
+    errno = olderrno;
+}
+
+/* sigchldfd() returns an fd which becomes readable whenever a child
+   exits, so that a loop can poll() for it along with other fds instead
+   of waking up to look. Read everything in it before reaping children
+   with waitpid( -1, true ). */
+static int clyde_sigchldfd ( lua_State *L )
+{
+    struct sigaction sa;
+
+    if ( sigchld_pipe[0] == -1 ) {
+        CHECK_ERR( "pipe", pipe( sigchld_pipe ));
+        fcntl( sigchld_pipe[0], F_SETFD, FD_CLOEXEC );
+        fcntl( sigchld_pipe[1], F_SETFD, FD_CLOEXEC );
+        fcntl( sigchld_pipe[0], F_SETFL, O_NONBLOCK );
+        fcntl( sigchld_pipe[1], F_SETFL, O_NONBLOCK );
+
+        memset( &sa, 0, sizeof sa );
+        sa.sa_handler = sigchld_handler;
+        sa.sa_flags   = SA_RESTART | SA_NOCLDSTOP;
+        sigemptyset( &sa.sa_mask );
+        CHECK_ERR( "sigaction", sigaction( SIGCHLD, &sa, NULL ));
+    }
+
+    lua_pushinteger( L, sigchld_pipe[0] );
+    return 1;
+}
+
+/* drain( fd ) reads and throws away whatever is waiting in fd, which
+   must be non-blocking, like the one sigchldfd() returns. */
+static int clyde_drain ( lua_State *L )
+{
+    char buf[256];
+    int fd = luaL_checkinteger( L, 1 );
+    ssize_t n;
+
+    do {
+        n = read( fd, buf, sizeof buf );
+    } while ( n > 0 || ( n == -1 && errno == EINTR ));
+    return 0;
+}
+
+/* Returns true if fd is 0, 1, 2, one end of the SIGCHLD pipe or in the
+   list at index 1. */
+static int fd_kept ( lua_State *L, int fd )
+{
+    int i, count = lua_objlen( L, 1 );
+    int kept = fd <= 2 || fd == sigchld_pipe[0] || fd == sigchld_pipe[1];
+
+    for ( i = 1 ; i <= count && !kept ; ++i ) {
+        lua_rawgeti( L, 1, i );
+        kept = lua_tointeger( L, -1 ) == fd;
+        lua_pop( L, 1 );
+    }
+    return kept;
+}
+
+/* closefds( keep ) takes every fd but 0, 1, 2, the pipe of sigchldfd()
+   and those in the list keep away from this process. Each one is made a copy of /dev/null
+   rather than closed, so that its number stays taken until whatever
+   still refers to it (like a socket waiting to be collected) closes
+   it, and a later open never gets closed by mistake. */
+static int clyde_closefds ( lua_State *L )
+{
+    int nullfd, fd;
+    DIR *dir;
+    struct dirent *ent;
+    long maxfd;
+
+    luaL_checktype( L, 1, LUA_TTABLE );
+    nullfd = open( "/dev/null", O_RDWR );
+    CHECK_ERR( "open", nullfd );
+
+    dir = opendir( "/proc/self/fd" );
+    if ( dir != NULL ) {
+        while (( ent = readdir( dir )) != NULL ) {
+            if ( !isdigit( (unsigned char) ent->d_name[0] )) continue;
+            fd = atoi( ent->d_name );
+            if ( fd == dirfd( dir ) || fd == nullfd || fd_kept( L, fd )) continue;
+            dup2( nullfd, fd );
+            fcntl( fd, F_SETFD, FD_CLOEXEC );
+        }
+        closedir( dir );
+    }
+    else {
+        maxfd = sysconf( _SC_OPEN_MAX );
+        for ( fd = 3 ; fd < maxfd ; ++fd ) {
+            if ( fd == nullfd || fd_kept( L, fd )
+                 || fcntl( fd, F_GETFD ) == -1 ) continue;
+            dup2( nullfd, fd );
+            fcntl( fd, F_SETFD, FD_CLOEXEC );
+        }
+    }
+
+    close( nullfd );
+    return 0;
+}
+
+/* setids( uid, gid [, user] ) gives up root for good: the groups
+   become gid and, with user, the groups user is a member of, then the
+   gid and the uid are set. */
+static int clyde_setids ( lua_State *L )
+{
+    uid_t uid        = luaL_checkinteger( L, 1 );
+    gid_t gid        = luaL_checkinteger( L, 2 );
+    const char *user = luaL_optstring( L, 3, NULL );
+
+    if ( user ) {
+        CHECK_ERR( "initgroups", initgroups( user, gid ));
+    }
+    else {
+        CHECK_ERR( "setgroups", setgroups( 1, &gid ));
+    }
+    CHECK_ERR( "setgid", setgid( gid ));
+    CHECK_ERR( "setuid", setuid( uid ));
+    return 0;
+}
+
 #define STDIN 0
 
 /* Save our old termio struct for the signal handler. */
@@ -396,8 +894,25 @@ static luaL_Reg const pkg_funcs[] = {
     { "mkdir",                      clyde_mkdir },
     { "umask",                      clyde_umask },
     { "arch",                       clyde_arch },
+    { "strhash",                    clyde_strhash },
+    { "sha256",                     clyde_sha256 },
+    { "sha256file",                 clyde_sha256file },
     { "getchar",                    clyde_getchar },
     { "setprocname",                clyde_setprocname },
+    { "nprocs",                     clyde_nprocs },
+    { "spawn",                      clyde_spawn },
+    { "waitpid",                    clyde_waitpid },
+    { "pipe",                       clyde_pipe },
+    { "fork",                       clyde_fork },
+    { "exit",                       clyde_exit },
+    { "read",                       clyde_read },
+    { "write",                      clyde_write },
+    { "close",                      clyde_close },
+    { "poll",                       clyde_poll },
+    { "sigchldfd",                  clyde_sigchldfd },
+    { "drain",                      clyde_drain },
+    { "closefds",                   clyde_closefds },
+    { "setids",                     clyde_setids },
     { NULL,                         NULL}
 };
 
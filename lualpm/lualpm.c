@@ -309,6 +309,7 @@ static luaL_Reg const pkg_funcs[] =
     { "checkdeps",                  lalpm_checkdeps },
     { "find_satisfier",             lalpm_find_satisfier },
     { "find_dbs_satisfier",         lalpm_find_dbs_satisfier },
+    { "satisfier_new",              lalpm_satisfier_new },
     { "sync_newversion",            lalpm_sync_newversion },
     { "compute_md5sum",             lalpm_compute_md5sum },
 
@@ -13,6 +13,11 @@ int lalpm_checkdeps(lua_State *L);
 int lalpm_find_satisfier(lua_State *L);
 int lalpm_find_dbs_satisfier(lua_State *L);
 
+/* SATISFIER INDEX */
+/* See satisfier.c */
+
+int lalpm_satisfier_new(lua_State *L);
+
 /* OPTIONS ******************************************************************/
 
 /* Generated by parsing option.c:
@@ -0,0 +1,409 @@
+#include <stdlib.h>
+#include <string.h>
+#include <alpm.h>
+#include <alpm_list.h>
+#include <lua.h>
+#include <lualib.h>
+#include <lauxlib.h>
+#include "types.h"
+#include "lualpm.h"
+
+/* SATISFIER INDEX
+ *
+ * Maps every name that packages provide (their own names included) to
+ * the packages providing it, so that "who satisfies foo>=1.2" is one
+ * hash lookup followed by a version check of the few providers of foo.
+ * Versions are compared like alpm_find_satisfier() does: a package
+ * satisfies a dependency on its name through its own version, and a
+ * provision through the version after its "=".  A provision without a
+ * version only satisfies dependencies without one.
+ *
+ * Each provider carries a tag ("local", "sync", ...) so one index can
+ * hold several databases and still be asked about one of them.  Adding
+ * a package replaces what was known of it under the same tag, which is
+ * how the index is kept up to date as packages are installed. */
+
+typedef enum depmod {
+    MOD_ANY, MOD_EQ, MOD_GE, MOD_LE, MOD_GT, MOD_LT
+} depmod;
+
+typedef struct provider {
+    const char      * name;     /* the name provided */
+    const char      * version;  /* its version, or NULL */
+    const char      * pkgname;  /* the package providing it */
+    const char      * pkgver;
+    const char      * tag;
+    struct provider * next;     /* next in the bucket of name */
+    struct provider * pkgnext;  /* next in the bucket of pkgname */
+} provider;
+
+typedef struct satisfier {
+    provider ** byname;
+    provider ** bypkg;
+    size_t      size;           /* buckets in each table, a power of 2 */
+    size_t      count;
+} satisfier;
+
+#define INITIAL_SIZE 256
+
+static size_t hash_name ( const char * name, size_t len )
+{
+    /* 32-bit FNV-1a */
+    unsigned long hash = 2166136261UL;
+    size_t i;
+
+    for ( i = 0 ; i < len ; i++ ) {
+        hash ^= (unsigned char) name[i];
+        hash  = ( hash * 16777619UL ) & 0xffffffffUL;
+    }
+    return (size_t) hash;
+}
+
+static size_t strhash ( const char * name )
+{
+    return hash_name( name, strlen( name ));
+}
+
+/* Splits a dependency string like "foo>=1.2" into its name, which is
+   not terminated, its modifier and its version. */
+static size_t parse_dep ( const char * dep, depmod * mod,
+                          const char ** version )
+{
+    size_t len = strcspn( dep, "<>=" );
+
+    *version = dep + len;
+    if ( dep[len] == '\0' )                         *mod = MOD_ANY;
+    else if ( strncmp( *version, ">=", 2 ) == 0 ) { *mod = MOD_GE; *version += 2; }
+    else if ( strncmp( *version, "<=", 2 ) == 0 ) { *mod = MOD_LE; *version += 2; }
+    else if ( **version == '=' )                  { *mod = MOD_EQ; *version += 1; }
+    else if ( **version == '>' )                  { *mod = MOD_GT; *version += 1; }
+    else                                          { *mod = MOD_LT; *version += 1; }
+
+    return len;
+}
+
+static int version_satisfies ( const char * have, depmod mod,
+                               const char * want )
+{
+    int cmp;
+
+    if ( mod == MOD_ANY ) return 1;
+    if ( have == NULL )   return 0;
+
+    cmp = alpm_pkg_vercmp( have, want );
+    switch ( mod ) {
+    case MOD_EQ: return cmp == 0;
+    case MOD_GE: return cmp >= 0;
+    case MOD_LE: return cmp <= 0;
+    case MOD_GT: return cmp > 0;
+    case MOD_LT: return cmp < 0;
+    default:     return 1;
+    }
+}
+
+static void grow ( satisfier * index )
+{
+    size_t      size   = index->size * 2;
+    provider ** byname = calloc( size, sizeof( provider * ));
+    provider ** bypkg  = calloc( size, sizeof( provider * ));
+    provider  * prov, * next;
+    size_t      i, h;
+
+    if ( byname == NULL || bypkg == NULL ) {
+        /* Longer chains are slower but still correct. */
+        free( byname );
+        free( bypkg );
+        return;
+    }
+
+    for ( i = 0 ; i < index->size ; i++ ) {
+        for ( prov = index->byname[i] ; prov ; prov = next ) {
+            next       = prov->next;
+            h          = strhash( prov->name ) & ( size - 1 );
+            prov->next = byname[h];
+            byname[h]  = prov;
+        }
+        for ( prov = index->bypkg[i] ; prov ; prov = next ) {
+            next          = prov->pkgnext;
+            h             = strhash( prov->pkgname ) & ( size - 1 );
+            prov->pkgnext = bypkg[h];
+            bypkg[h]      = prov;
+        }
+    }
+
+    free( index->byname );
+    free( index->bypkg );
+    index->byname = byname;
+    index->bypkg  = bypkg;
+    index->size   = size;
+}
+
+/* Copies a string of len bytes to *dest and returns the end of the
+   copy, where the next string goes. */
+static char * copy_string ( char * dest, const char * src, size_t len,
+                            const char ** result )
+{
+    memcpy( dest, src, len );
+    dest[len] = '\0';
+    *result   = dest;
+    return dest + len + 1;
+}
+
+/* Adds that pkgname provides provision, which is either a name or
+   "name=version". A version given separately overrides the latter. */
+static int add_provider ( satisfier * index, const char * provision,
+                          const char * version, const char * pkgname,
+                          const char * pkgver, const char * tag )
+{
+    const char * eq      = strchr( provision, '=' );
+    size_t       namelen = eq ? (size_t) ( eq - provision ) : strlen( provision );
+    size_t       verlen;
+    size_t       pkglen  = strlen( pkgname );
+    size_t       pvlen   = pkgver ? strlen( pkgver ) : 0;
+    size_t       taglen  = strlen( tag );
+    provider   * prov;
+    char       * str;
+    size_t       h;
+
+    if ( version == NULL && eq ) version = eq + 1;
+    verlen = version ? strlen( version ) : 0;
+
+    /* The provider and its strings share one allocation. */
+    prov = malloc( sizeof( provider ) + namelen + verlen + pkglen + pvlen
+                   + taglen + 5 );
+    if ( prov == NULL ) return -1;
+
+    str = (char *) ( prov + 1 );
+    str = copy_string( str, provision, namelen, &prov->name );
+    prov->version = NULL;
+    if ( version ) str = copy_string( str, version, verlen, &prov->version );
+    str = copy_string( str, pkgname, pkglen, &prov->pkgname );
+    prov->pkgver = NULL;
+    if ( pkgver ) str = copy_string( str, pkgver, pvlen, &prov->pkgver );
+    copy_string( str, tag, taglen, &prov->tag );
+
+    if ( index->count >= index->size ) grow( index );
+
+    h                  = hash_name( provision, namelen ) & ( index->size - 1 );
+    prov->next         = index->byname[h];
+    index->byname[h]   = prov;
+    h                  = hash_name( pkgname, pkglen ) & ( index->size - 1 );
+    prov->pkgnext      = index->bypkg[h];
+    index->bypkg[h]    = prov;
+    index->count++;
+
+    return 0;
+}
+
+/* Forgets everything pkgname provides under tag, or under any tag if
+   tag is NULL. */
+static void remove_package ( satisfier * index, const char * pkgname,
+                             const char * tag )
+{
+    provider ** link = &index->bypkg[ strhash( pkgname ) & ( index->size - 1 ) ];
+    provider ** namelink;
+    provider  * prov;
+
+    while (( prov = *link )) {
+        if ( strcmp( prov->pkgname, pkgname ) != 0
+             || ( tag && strcmp( prov->tag, tag ) != 0 )) {
+            link = &prov->pkgnext;
+            continue;
+        }
+
+        namelink = &index->byname[ strhash( prov->name ) & ( index->size - 1 ) ];
+        while ( *namelink != prov ) namelink = &(*namelink)->next;
+        *namelink = prov->next;
+
+        *link = prov->pkgnext;
+        free( prov );
+        index->count--;
+    }
+}
+
+static void add_package ( lua_State * L, satisfier * index,
+                          const char * pkgname, const char * pkgver,
+                          alpm_list_t * provides, const char * tag )
+{
+    alpm_list_t * i;
+    int           err;
+
+    remove_package( index, pkgname, tag );
+
+    /* A package provides its own name, with its own version. */
+    err = add_provider( index, pkgname, pkgver, pkgname, pkgver, tag );
+    for ( i = provides ; i && !err ; i = alpm_list_next( i )) {
+        err = add_provider( index, alpm_list_getdata( i ), NULL, pkgname,
+                            pkgver, tag );
+    }
+
+    if ( err ) luaL_error( L, "out of memory" );
+}
+
+static satisfier * check_satisfier ( lua_State * L, int narg )
+{
+    return luaL_checkudata( L, narg, "satisfier_t" );
+}
+
+/* index:add( pkgname, pkgver, provides [, tag] )
+   Adds a package which is not in any alpm database, like one we are
+   going to build. provides is a table of strings like "foo=1.2". */
+static int lsatisfier_add ( lua_State * L )
+{
+    satisfier   * index    = check_satisfier( L, 1 );
+    const char  * pkgname  = luaL_checkstring( L, 2 );
+    const char  * pkgver   = luaL_optstring( L, 3, NULL );
+    const char  * tag      = luaL_optstring( L, 5, "" );
+    alpm_list_t * provides = NULL;
+
+    if ( !lua_isnoneornil( L, 4 )) {
+        luaL_checktype( L, 4, LUA_TTABLE );
+        provides = lstring_table_to_alpm_list( L, 4 );
+    }
+
+    add_package( L, index, pkgname, pkgver, provides, tag );
+    FREELIST( provides );
+
+    return 0;
+}
+
+/* index:add_pkg( pkg [, tag] ) */
+static int lsatisfier_add_pkg ( lua_State * L )
+{
+    satisfier  * index = check_satisfier( L, 1 );
+    pmpkg_t    * pkg   = check_pmpkg( L, 2 );
+    const char * tag   = luaL_optstring( L, 3, "" );
+
+    add_package( L, index, alpm_pkg_get_name( pkg ),
+                 alpm_pkg_get_version( pkg ), alpm_pkg_get_provides( pkg ),
+                 tag );
+
+    return 0;
+}
+
+/* index:add_db( db [, tag] ) */
+static int lsatisfier_add_db ( lua_State * L )
+{
+    satisfier   * index = check_satisfier( L, 1 );
+    pmdb_t      * db    = check_pmdb( L, 2 );
+    const char  * tag   = luaL_optstring( L, 3, "" );
+    alpm_list_t * i;
+    pmpkg_t     * pkg;
+
+    for ( i = alpm_db_get_pkgcache( db ) ; i ; i = alpm_list_next( i )) {
+        pkg = alpm_list_getdata( i );
+        add_package( L, index, alpm_pkg_get_name( pkg ),
+                     alpm_pkg_get_version( pkg ),
+                     alpm_pkg_get_provides( pkg ), tag );
+    }
+
+    return 0;
+}
+
+/* index:remove( pkgname [, tag] ) */
+static int lsatisfier_remove ( lua_State * L )
+{
+    satisfier  * index   = check_satisfier( L, 1 );
+    const char * pkgname = luaL_checkstring( L, 2 );
+    const char * tag     = luaL_optstring( L, 3, NULL );
+
+    remove_package( index, pkgname, tag );
+
+    return 0;
+}
+
+/* index:find( depstring [, tag] )
+   Returns the name, version and tag of a package satisfying depstring,
+   or nil. Like alpm, a package with the wanted name is preferred to
+   other packages which provide it. */
+static int lsatisfier_find ( lua_State * L )
+{
+    satisfier  * index = check_satisfier( L, 1 );
+    const char * dep   = luaL_checkstring( L, 2 );
+    const char * tag   = luaL_optstring( L, 3, NULL );
+    const char * version;
+    provider   * prov, * found = NULL;
+    depmod       mod;
+    size_t       len;
+
+    len  = parse_dep( dep, &mod, &version );
+    prov = index->byname[ hash_name( dep, len ) & ( index->size - 1 ) ];
+    for ( ; prov ; prov = prov->next ) {
+        if ( strncmp( prov->name, dep, len ) != 0 || prov->name[len] != '\0'
+             || ( tag && strcmp( prov->tag, tag ) != 0 )
+             || !version_satisfies( prov->version, mod, version )) {
+            continue;
+        }
+
+        if ( strcmp( prov->name, prov->pkgname ) == 0 ) {
+            found = prov;
+            break;
+        }
+        if ( found == NULL ) found = prov;
+    }
+
+    if ( found == NULL ) {
+        lua_pushnil( L );
+        return 1;
+    }
+
+    lua_pushstring( L, found->pkgname );
+    push_string( L, found->pkgver );
+    lua_pushstring( L, found->tag );
+    return 3;
+}
+
+static int lsatisfier_gc ( lua_State * L )
+{
+    satisfier * index = check_satisfier( L, 1 );
+    provider  * prov, * next;
+    size_t      i;
+
+    if ( index->byname ) {
+        for ( i = 0 ; i < index->size ; i++ ) {
+            for ( prov = index->byname[i] ; prov ; prov = next ) {
+                next = prov->next;
+                free( prov );
+            }
+        }
+    }
+    free( index->byname );
+    free( index->bypkg );
+    index->byname = index->bypkg = NULL;
+
+    return 0;
+}
+
+/* alpm.satisfier_new() returns an empty satisfier index. */
+int lalpm_satisfier_new ( lua_State * L )
+{
+    satisfier * index = lua_newuserdata( L, sizeof( satisfier ));
+
+    index->size   = INITIAL_SIZE;
+    index->count  = 0;
+    index->byname = calloc( INITIAL_SIZE, sizeof( provider * ));
+    index->bypkg  = calloc( INITIAL_SIZE, sizeof( provider * ));
+
+    if ( luaL_newmetatable( L, "satisfier_t" )) {
+        static luaL_Reg const methods[] = {
+            { "add",                    lsatisfier_add },
+            { "add_pkg",                lsatisfier_add_pkg },
+            { "add_db",                 lsatisfier_add_db },
+            { "remove",                 lsatisfier_remove },
+            { "find",                   lsatisfier_find },
+            { NULL,                     NULL }
+        };
+        lua_newtable( L );
+        luaL_register( L, NULL, methods );
+        lua_setfield( L, -2, "__index" );
+        lua_pushcfunction( L, lsatisfier_gc );
+        lua_setfield( L, -2, "__gc" );
+    }
+    lua_setmetatable( L, -2 );
+
+    if ( index->byname == NULL || index->bypkg == NULL ) {
+        return luaL_error( L, "out of memory" );
+    }
+
+    return 1;
+}